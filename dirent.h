@@ -12,11 +12,34 @@ typedef void DIR;
 
 #define FS_NOINLINE __attribute__((noinline))
 
+enum {
+    DT_UNKNOWN = 0,
+    DT_FIFO = 1,
+    DT_CHR = 2,
+    DT_DIR = 4,
+    DT_BLK = 6,
+    DT_REG = 8,
+    DT_LNK = 10,
+    DT_SOCK = 12
+};
+
+/* readdir hands out the records of getdents64, so the layouts match */
 struct dirent {
-    ino_t d_ino;
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
     char d_name[ 256 ];
 };
 
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
 int alphasort( const struct dirent **, const struct dirent ** );
 
 FS_NOINLINE int closedir( DIR *dirp );
@@ -31,6 +54,7 @@ FS_NOINLINE int scandir( const char *, struct dirent ***,
                          int (*compare)( const struct dirent **, const struct dirent ** ));
 FS_NOINLINE void seekdir( DIR *, long );
 FS_NOINLINE long telldir( DIR * );
+FS_NOINLINE ssize_t getdents64( int fd, void *dirp, size_t count );
 
 #ifdef __cplusplus
 }
@@ -56,6 +56,11 @@
 # define MAP_FIXED	 0x0100	/* Map address must be exactly as requested. */
 # define MAP_HASSEMPHORE 0x0400	/* Region may contain semaphores.  */
 
+/* Flags to `msync'.  */
+#define MS_ASYNC	1		/* Sync memory asynchronously.  */
+#define MS_SYNC		4		/* Synchronous memory sync.  */
+#define MS_INVALIDATE	2		/* Invalidate the caches.  */
+
 
 /* Bits in the file status flags returned by F_GETFL.
    These are all the O_* flags, plus FREAD and FWRITE, which are
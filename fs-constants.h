@@ -13,7 +13,9 @@ enum class Seek {
     Undefined,
     Set,
     Current,
-    End
+    End,
+    Data,
+    Hole
 };
 
 enum class SocketType {
@@ -24,8 +26,17 @@ enum class SocketType {
 const int CURRENT_DIRECTORY = -100;
 const int PATH_LIMIT = 1023;
 const int FILE_NAME_LIMIT = 255;
+const int SYMLINK_LIMIT = 40;
+// default value of RLIMIT_NOFILE
 const int FILE_DESCRIPTOR_LIMIT = 1024;
+// greatest value RLIMIT_NOFILE may be raised to
+const int FILE_DESCRIPTOR_HARD_LIMIT = 1 << 20;
+const int DESCRIPTOR_PAGE_SIZE = 64;
 const int PIPE_SIZE_LIMIT = 1024;
+const int FILE_CHUNK_SIZE = 1024;
+const int DIRECTORY_INDEX_THRESHOLD = 64;
+const int DENTRY_CACHE_LIMIT = 4096;
+const int DIRECTORY_BUFFER_SIZE = 4096;
 
 namespace flags {
 
@@ -74,6 +85,13 @@ enum class Mapping {
     MapAnon = 4,
 };
 
+enum class Protection {
+    None = 0,
+    Read = 1,
+    Write = 2,
+    Exec = 4,
+};
+
 } // namespace flags
 
 using storage::operator|;
@@ -13,6 +13,9 @@
 namespace divine {
 namespace fs {
 
+// descriptors are accounted for separately, see memory::Stats
+using DescriptorAllocator = memory::Allocator< char, memory::Category::Descriptors >;
+
 struct FileDescriptor {
 
     FileDescriptor() :
@@ -54,20 +57,44 @@ struct FileDescriptor {
         return file->canWrite();
     }
 
-    virtual long long read( void *buf, size_t length ) {
-        if ( !_inode )
-            throw Error( EBADF );
-        if ( !_flags.has( flags::Open::Read ) )
-            throw Error( EBADF );
+    // error read() fails with before touching the file, 0 if there is none
+    int readError() const {
+        if ( !_inode || !_flags.has( flags::Open::Read ) )
+            return EBADF;
 
         File *file = _inode->data()->as< File >();
         if ( !file )
-            throw Error( EBADF );
+            return EBADF;
         if ( _flags.has( flags::Open::NonBlock ) && !file->canRead() )
-            throw Error( EAGAIN );
+            return EAGAIN;
+        return 0;
+    }
+
+    // error write() fails with before touching the file, 0 if there is none
+    int writeError() const {
+        if ( !_inode || !_flags.has( flags::Open::Write ) )
+            return EBADF;
 
+        File *file = _inode->data()->as< File >();
+        if ( !file )
+            return EBADF;
+        if ( _flags.has( flags::Open::NonBlock ) && !file->canWrite() )
+            return EAGAIN;
+        return 0;
+    }
+
+    virtual long long read( void *buf, size_t length ) {
+        if ( int error = readError() )
+            throw Error( error );
+
+        // readError() checked the kind already
+        File *file = static_cast< File * >( _inode->data() );
         char *dst = reinterpret_cast< char * >( buf );
-        if ( !file->read( dst, _offset, length ) )
+        // regular files are final, the call is resolved statically
+        bool done = file->kind() == DataKind::RegularFile ?
+            static_cast< RegularFile * >( file )->read( dst, _offset, length ) :
+            file->read( dst, _offset, length );
+        if ( !done )
             throw Error( EBADF );
 
         _setOffset( _offset + length );
@@ -75,22 +102,19 @@ struct FileDescriptor {
     }
 
     virtual long long write( const void *buf, size_t length ) {
-        if ( !_inode )
-            throw Error( EBADF );
-        if ( !_flags.has( flags::Open::Write ) )
-            throw Error( EBADF );
+        if ( int error = writeError() )
+            throw Error( error );
 
-        File *file = _inode->data()->as< File >();
-        if ( !file )
-            throw Error( EBADF );
-        if ( _flags.has( flags::Open::NonBlock ) && !file->canWrite() )
-            throw Error( EAGAIN );
+        File *file = static_cast< File * >( _inode->data() );
 
         if ( _flags.has( flags::Open::Append ) )
             _offset = file->size();
 
         const char *src = reinterpret_cast< const char * >( buf );
-        if ( !file->write( src, _offset, length ) )
+        bool done = file->kind() == DataKind::RegularFile ?
+            static_cast< RegularFile * >( file )->write( src, _offset, length ) :
+            file->write( src, _offset, length );
+        if ( !done )
             throw Error( EBADF );
 
         _setOffset( _offset + length );
@@ -101,9 +125,42 @@ struct FileDescriptor {
         return _offset;
     }
     virtual void offset( size_t off ) {
+        if ( off != _offset )
+            _entry = Name();
         _offset = off;
     }
 
+    // the offset together with the last directory entry read
+    struct Position {
+        size_t offset;
+        Name entry;
+    };
+    Position position() const {
+        return { _offset, _entry };
+    }
+    void position( const Position &p ) {
+        _offset = p.offset;
+        _entry = p.entry;
+    }
+
+    /*
+     * Offsets of directories count the entries read. The descriptor also
+     * remembers the name of the last one, so that reading goes on with the
+     * next name even if entries were created or removed in the meantime.
+     */
+    const DirectoryEntry *directoryEntry( const Directory *dir ) const {
+        if ( !_offset )
+            return dir->after( nullptr );
+        if ( !_entry.empty() )
+            return dir->after( &_entry );
+        // the offset was set explicitly
+        return dir->at( _offset );
+    }
+    void directoryEntryRead( const DirectoryEntry &entry ) {
+        _entry = entry.name();
+        ++_offset;
+    }
+
     size_t size() {
         return _inode ? _inode->size() : 0;
     }
@@ -120,10 +177,15 @@ struct FileDescriptor {
         return _inode;
     }
 
+    void inode( Node node ) {
+        _inode = std::move( node );
+    }
+
     void close() {
         _inode.reset();
         _flags = flags::Open::NoFlags;
         _offset = 0;
+        _entry = Name();
     }
 
     Flags< flags::Open > flags() const {
@@ -142,6 +204,7 @@ protected:
     Node _inode;
     Flags< flags::Open > _flags;
     size_t _offset;
+    Name _entry;
 };
 
 struct PipeDescriptor : FileDescriptor {
@@ -196,43 +259,98 @@ protected:
     }
 };
 
+/*
+ * Stream of an open directory. Entries are read from the descriptor in
+ * batches; the buffer keeps the records not handed out yet, their layout is
+ * up to the caller.
+ *
+ * Positions of the stream are told by cookies (telldir). A cookie stands for
+ * the position of the descriptor past an entry, which keeps the name of the
+ * entry, so seeking to it goes on with the next name even if entries were
+ * created or removed in the meantime. Cookie 0 is the beginning, the others
+ * are valid for this stream only.
+ */
 struct DirectoryDescriptor {
+    using Position = FileDescriptor::Position;
 
     DirectoryDescriptor( Node inode, int fd ) :
+        _begin( 0 ),
+        _end( 0 ),
+        _last( nullptr ),
+        _offset( 0 ),
+        _cookie( 0 ),
         _fd( fd )
     {
         if ( !inode->mode().isDirectory() )
             throw Error( ENOTDIR );
+    }
 
-        Directory *dir = inode->data()->as< Directory >();
-
-        _items.reserve( dir->size() );
-        for ( const auto &item : *dir ) {
-            _items.emplace_back( item );
-        }
-        rewind();
+    char *buffer() {
+        return _buffer;
+    }
+    size_t capacity() const {
+        return sizeof( _buffer );
     }
 
-    void rewind() {
-        _position = _items.begin();
+    // the first record not handed out yet
+    char *current() {
+        return _begin < _end ? _buffer + _begin : nullptr;
+    }
+    void fill( size_t length ) {
+        _begin = 0;
+        _end = length;
     }
-    void next() {
-        ++_position;
+    // name is the one of the record, offset that of the directory past it
+    void advance( size_t length, const char *name, size_t offset ) {
+        _begin += length;
+        _last = name;
+        _offset = offset;
     }
 
-    const DirectoryItemLabel *get() const {
-        if ( _position == _items.end() )
-            return nullptr;
-        return &*_position;
+    // the name of the last record handed out since the last seek, if any
+    const char *last() const {
+        return _last;
+    }
+    size_t offset() const {
+        return _offset;
     }
 
-    void seek( long off ) {
-        rewind();
-        _position += off;
+    void seek( long cookie ) {
+        _begin = _end = 0;
+        _last = nullptr;
+        _cookie = cookie;
+    }
+    // the cookie of the position reached by seek(), see last() for later ones
+    long cookie() const {
+        return _cookie;
+    }
+    // the position past the last record was told, the buffer stays
+    void cookie( long cookie ) {
+        _last = nullptr;
+        _cookie = cookie;
     }
 
-    long tell() const {
-        return long( _position - _items.begin() );
+    // the cookie of a position, the same one for the same entry
+    long mark( const Position &position ) {
+        if ( !position.offset )
+            return 0;
+        if ( !position.entry.empty() ) {
+            auto known = _cookies.find( position.entry.data() );
+            if ( known != _cookies.end() )
+                return known->second;
+        }
+        _marks.push_back( position );
+        long cookie = _marks.size();
+        if ( !position.entry.empty() )
+            _cookies.emplace( position.entry.data(), cookie );
+        return cookie;
+    }
+    Position marked( long cookie ) const {
+        if ( !cookie )
+            return { 0, Name() };
+        if ( cookie < 0 || size_t( cookie ) > _marks.size() )
+            throw Error( EINVAL );
+        return _marks[ cookie - 1 ];
     }
 
     int fd() const {
@@ -241,9 +359,16 @@ struct DirectoryDescriptor {
 
 private:
 
-    utils::Vector< DirectoryItemLabel > _items;
-    utils::Vector< DirectoryItemLabel >::const_iterator _position;
+    alignas( uint64_t ) char _buffer[ DIRECTORY_BUFFER_SIZE ];
+    size_t _begin;
+    size_t _end;
+    const char *_last;
+    size_t _offset;
+    long _cookie;
     int _fd;
+    utils::Vector< Position > _marks;
+    // cookies by the interned name the position follows
+    utils::Map< const char *, long > _cookies;
 };
 
 struct SocketDescriptor : FileDescriptor {
@@ -319,6 +444,172 @@ private:
     Socket *_socket;
 };
 
+/*
+ * Open descriptors of a manager up to a limit that may change at run time.
+ * Slots are allocated by pages of DESCRIPTOR_PAGE_SIZE once some descriptor
+ * of the page is open, and the pages are indexed by a map, so a high
+ * descriptor costs nothing for the unused range below it.
+ */
+struct DescriptorTable {
+    using Descriptor = std::shared_ptr< FileDescriptor >;
+
+    explicit DescriptorTable( size_t limit ) :
+        _used( limit )
+    {}
+
+    size_t limit() const {
+        return _used.limit();
+    }
+    // descriptors at or above a lowered limit stay open
+    void limit( size_t limit ) {
+        size_t previous = _used.limit();
+        _used.resize( limit );
+        forEach( [&]( int fd, Descriptor & ) {
+            if ( size_t( fd ) >= previous && size_t( fd ) < limit )
+                _used.set( fd );
+        }, previous );
+    }
+
+    Descriptor *find( int fd ) {
+        if ( fd < 0 )
+            return nullptr;
+        auto page = _pages.find( fd / DESCRIPTOR_PAGE_SIZE );
+        if ( page == _pages.end() || !page->second.slots[ fd % DESCRIPTOR_PAGE_SIZE ] )
+            return nullptr;
+        return &page->second.slots[ fd % DESCRIPTOR_PAGE_SIZE ];
+    }
+
+    // a null descriptor closes the slot
+    void set( int fd, Descriptor f ) {
+        auto page = _pages.find( fd / DESCRIPTOR_PAGE_SIZE );
+        if ( page == _pages.end() ) {
+            if ( !f )
+                return;
+            page = _pages.emplace( fd / DESCRIPTOR_PAGE_SIZE, Page() ).first;
+        }
+
+        Descriptor &slot = page->second.slots[ fd % DESCRIPTOR_PAGE_SIZE ];
+        if ( bool( slot ) != bool( f ) ) {
+            page->second.count += f ? 1 : -1;
+            if ( size_t( fd ) < _used.limit() ) {
+                if ( f )
+                    _used.set( fd );
+                else
+                    _used.reset( fd );
+            }
+        }
+        slot = std::move( f );
+
+        if ( !page->second.count )
+            _pages.erase( page );
+    }
+
+    // the lowest free descriptor not below the bound, -1 if there is none
+    int lowest( int from = 0 ) const {
+        size_t fd = _used.lowest( from );
+        return fd == utils::SlotBitmap::NONE ? -1 : int( fd );
+    }
+
+    // calls f( fd, descriptor ) for every open descriptor from the bound in ascending order
+    template< typename F >
+    void forEach( F f, size_t from = 0 ) {
+        for ( auto page = _pages.lower_bound( from / DESCRIPTOR_PAGE_SIZE ); page != _pages.end(); ++page ) {
+            auto &slots = page->second.slots;
+            for ( size_t i = 0; i < slots.size(); ++i ) {
+                if ( slots[ i ] )
+                    f( int( page->first * DESCRIPTOR_PAGE_SIZE + i ), slots[ i ] );
+            }
+        }
+    }
+
+private:
+    struct Page {
+        Page() :
+            slots( DESCRIPTOR_PAGE_SIZE ),
+            count( 0 )
+        {}
+
+        std::vector< Descriptor, memory::Allocator< Descriptor, memory::Category::Descriptors > > slots;
+        unsigned count;
+    };
+
+    utils::Map< size_t, Page > _pages;
+    utils::SlotBitmap _used;
+};
+
+/*
+ * Open directory streams. A handle is not an address: it encodes a slot of
+ * the table and the generation of the slot, which changes with every close,
+ * so handles resolve in constant time and stale ones are recognized. A slot
+ * whose generations have run out is retired instead of wrapping around.
+ */
+struct DirectoryTable {
+    using Descriptor = std::shared_ptr< DirectoryDescriptor >;
+
+    void *open( Descriptor descriptor ) {
+        size_t slot;
+        if ( !_free.empty() ) {
+            slot = _free.back();
+            _free.pop_back();
+        }
+        else {
+            slot = _slots.size();
+            if ( slot + 1 > SLOT_MASK )
+                throw Error( EMFILE );
+            _slots.emplace_back();
+        }
+        _slots[ slot ].descriptor = std::move( descriptor );
+        return _handle( slot );
+    }
+
+    DirectoryDescriptor *find( void *handle ) const {
+        const Slot *slot = _slot( handle );
+        return slot ? slot->descriptor.get() : nullptr;
+    }
+
+    // returns false for handles which are not open
+    bool close( void *handle ) {
+        Slot *slot = const_cast< Slot * >( _slot( handle ) );
+        if ( !slot )
+            return false;
+        slot->descriptor.reset();
+        if ( ++slot->generation <= GENERATION_MASK )
+            _free.push_back( slot - _slots.data() );
+        return true;
+    }
+
+private:
+    // the lower half of a handle is the slot plus one, the upper half the generation
+    static const int SLOT_BITS = sizeof( uintptr_t ) * 4;
+    static const uintptr_t SLOT_MASK = ( uintptr_t( 1 ) << SLOT_BITS ) - 1;
+    static const uintptr_t GENERATION_MASK = ~uintptr_t( 0 ) >> SLOT_BITS;
+
+    struct Slot {
+        Slot() :
+            generation( 0 )
+        {}
+
+        Descriptor descriptor;
+        uintptr_t generation;
+    };
+
+    void *_handle( size_t slot ) const {
+        uintptr_t generation = _slots[ slot ].generation & GENERATION_MASK;
+        return reinterpret_cast< void * >( generation << SLOT_BITS | ( slot + 1 ) );
+    }
+
+    const Slot *_slot( void *handle ) const {
+        uintptr_t value = reinterpret_cast< uintptr_t >( handle );
+        size_t slot = ( value & SLOT_MASK ) - 1;
+        if ( slot >= _slots.size() || !_slots[ slot ].descriptor || _handle( slot ) != handle )
+            return nullptr;
+        return &_slots[ slot ];
+    }
+
+    utils::Vector< Slot > _slots;
+    utils::Vector< size_t > _free;
+};
+
 } // namespace fs
 } // namespace divine
 
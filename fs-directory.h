@@ -4,6 +4,7 @@
 #include <cerrno>
 
 #include "fs-inode.h"
+#include "fs-name.h"
 #include "fs-utils.h"
 #include "fs-constants.h"
 
@@ -15,13 +16,13 @@ namespace fs {
 
 struct DirectoryEntry {
 
-    DirectoryEntry( utils::String name, Node inode ) :
+    DirectoryEntry( Name name, Node inode ) :
         _name( std::move( name ) ),
         _inode( std::move( inode ) ),
         _weak( false )
     {}
 
-    DirectoryEntry( utils::String name, WeakNode inode ) :
+    DirectoryEntry( Name name, WeakNode inode ) :
         _name( std::move( name ) ),
         _inode( std::move( inode ) ),
         _weak( true )
@@ -59,10 +60,7 @@ struct DirectoryEntry {
         return *this;
     }
 
-    utils::String &name() {
-        return _name;
-    }
-    const utils::String &name() const {
+    const Name &name() const {
         return _name;
     }
 
@@ -73,6 +71,11 @@ struct DirectoryEntry {
         return _weak ? _inode.weak.lock() : _inode.strong;
     }
 
+    // "." and ".." do not keep their nodes alive
+    bool weak() const {
+        return _weak;
+    }
+
     void swap( DirectoryEntry &other ) {
         using std::swap;
         swap( _name, other._name );
@@ -95,7 +98,7 @@ struct DirectoryEntry {
     }
 
 private:
-    utils::String _name;
+    Name _name;
     union _U {
         Node strong;
         WeakNode weak;
@@ -115,6 +118,9 @@ private:
 };
 
 struct DirectoryItemLabel {
+    DirectoryItemLabel() :
+        _ino( 0 )
+    {}
     DirectoryItemLabel( const DirectoryEntry &entry ) :
         _name( entry.name() ),
         _ino( entry.inode()->ino() )
@@ -128,7 +134,7 @@ struct DirectoryItemLabel {
         return *this;
     }
 
-    const utils::String &name() const {
+    const Name &name() const {
         return _name;
     }
     unsigned ino() const {
@@ -136,42 +142,259 @@ struct DirectoryItemLabel {
     }
 
 private:
-    utils::String _name;
+    Name _name;
     unsigned _ino;
 };
 
+/*
+ * Cache of name lookups shared by directories of one manager. Entries are
+ * keyed by the serial number of the directory, which is unique for every
+ * directory instance including copies, and the name. A directory drops the
+ * entry of every name it modifies and all of its entries when it goes away,
+ * so a cached node is always named by its directory as well.
+ *
+ * Names which were not found are cached too (negative entries), so repeated
+ * probes of missing files do not search the directory again.
+ *
+ * The table is direct-mapped: a new entry replaces the one in its slot. It
+ * grows up to DENTRY_CACHE_LIMIT slots, a larger working set only loses the
+ * entries which collide.
+ */
+struct DentryCache {
+
+    DentryCache() :
+        _used( 0 )
+    {}
+    DentryCache( const DentryCache & ) = delete;
+    DentryCache &operator=( const DentryCache & ) = delete;
+
+    static uint64_t key( uint64_t directory, const char *name, size_t length ) {
+        return utils::hash( name, length, directory );
+    }
+
+    // on a hit the node is set, it stays empty for a negative entry
+    bool find( uint64_t key, uint64_t directory, const char *name, size_t length, Node &node ) const {
+        if ( _slots.empty() )
+            return false;
+        const Entry &e = _slot( key );
+        if ( !e.matches( key, directory, name, length ) )
+            return false;
+        node = e.inode;
+        return true;
+    }
+
+    // an empty node makes a negative entry
+    void insert( uint64_t key, uint64_t directory, Name name, Node node ) {
+        if ( _slots.size() < size_t( DENTRY_CACHE_LIMIT ) && _used >= _slots.size() / 4 * 3 )
+            _grow();
+        _store( key, directory, std::move( name ), std::move( node ) );
+    }
+
+    void invalidate( uint64_t directory, const char *name, size_t length ) {
+        if ( _slots.empty() )
+            return;
+        uint64_t k = key( directory, name, length );
+        Entry &e = _slot( k );
+        if ( e.matches( k, directory, name, length ) ) {
+            e = Entry();
+            --_used;
+        }
+    }
+
+private:
+    struct Entry {
+        Entry() :
+            key( 0 ),
+            directory( 0 )
+        {}
+
+        uint64_t key;
+        // serials start at one, zero marks an empty slot
+        uint64_t directory;
+        Name name;
+        Node inode;
+
+        bool matches( uint64_t k, uint64_t dir, const char *n, size_t length ) const {
+            return key == k && directory == dir && !name.compare( n, length );
+        }
+    };
+
+    Entry &_slot( uint64_t key ) {
+        return _slots[ key & ( _slots.size() - 1 ) ];
+    }
+    const Entry &_slot( uint64_t key ) const {
+        return _slots[ key & ( _slots.size() - 1 ) ];
+    }
+
+    void _store( uint64_t key, uint64_t directory, Name name, Node node ) {
+        Entry &e = _slot( key );
+        if ( !e.directory )
+            ++_used;
+        e.key = key;
+        e.directory = directory;
+        e.name = std::move( name );
+        e.inode = std::move( node );
+    }
+
+    void _grow() {
+        utils::Vector< Entry > slots( std::max< size_t >( 64, 2 * _slots.size() ) );
+        _slots.swap( slots );
+        _used = 0;
+        for ( auto &e : slots ) {
+            if ( e.directory )
+                _store( e.key, e.directory, std::move( e.name ), std::move( e.inode ) );
+        }
+    }
+
+    utils::Vector< Entry > _slots;
+    size_t _used;
+};
+
+/*
+ * Entries are kept sorted by name, so the order of readdir does not depend
+ * on the history of the directory. Small directories use a sorted vector,
+ * directories with more than DIRECTORY_INDEX_THRESHOLD entries switch to a
+ * red-black tree (std::map) to keep create and remove logarithmic.
+ */
 struct Directory : DataItem {
-    using Items = utils::Vector< DirectoryEntry >;
+    static const unsigned short KIND = DataKind::Directory;
 
-    Directory( WeakNode self, WeakNode parent = WeakNode{} ) :
-        _items{
-            DirectoryEntry{ ".", self },
-            DirectoryEntry{ "..", !parent.expired() ? parent : self }
+    using Items = std::vector< DirectoryEntry, memory::Allocator< DirectoryEntry, memory::Category::Directories > >;
+    // views of the names of the entries, lookups need not allocate
+    struct Key {
+        const char *data;
+        size_t size;
+
+        bool operator<( const Key &other ) const {
+            int r = std::char_traits< char >::compare( data, other.data, std::min( size, other.size ) );
+            return r < 0 || ( !r && size < other.size );
+        }
+    };
+    using Index = std::map< Key, DirectoryEntry, std::less< Key >,
+        memory::Allocator< std::pair< const Key, DirectoryEntry >, memory::Category::Directories > >;
+
+    template< typename Entry, typename ItemIterator, typename IndexIterator >
+    struct Iterator {
+        Iterator( ItemIterator item ) :
+            _item( item ),
+            _indexed( false )
+        {}
+        Iterator( IndexIterator entry ) :
+            _entry( entry ),
+            _indexed( true )
+        {}
+
+        Entry &operator*() const {
+            return _indexed ? _entry->second : *_item;
+        }
+        Entry *operator->() const {
+            return &**this;
+        }
+
+        Iterator &operator++() {
+            if ( _indexed )
+                ++_entry;
+            else
+                ++_item;
+            return *this;
         }
+
+        bool operator==( const Iterator &other ) const {
+            return _indexed ? _entry == other._entry : _item == other._item;
+        }
+        bool operator!=( const Iterator &other ) const {
+            return !( *this == other );
+        }
+
+    private:
+        ItemIterator _item;
+        IndexIterator _entry;
+        bool _indexed;
+    };
+
+    using iterator = Iterator< DirectoryEntry, Items::iterator, Index::iterator >;
+    using const_iterator = Iterator< const DirectoryEntry, Items::const_iterator, Index::const_iterator >;
+
+    // names of the entries are interned in the table
+    Directory( WeakNode self, WeakNode parent, std::shared_ptr< NameTable > names ) :
+        DataItem( KIND ),
+        _items{
+            DirectoryEntry{ names->intern( ".", 1 ), self },
+            DirectoryEntry{ names->intern( "..", 2 ), !parent.expired() ? parent : self }
+        },
+        _indexed( false ),
+        _serial( _nextSerial() ),
+        _names( std::move( names ) )
+    {}
+
+    Directory( const Directory &other ) :
+        DataItem( other ),
+        _items( other._items ),
+        _index( other._index ),
+        _indexed( other._indexed ),
+        _serial( _nextSerial() ),
+        _cache( other._cache ),
+        _names( other._names )
     {}
 
+    ~Directory() {
+        // cached lookups must not keep the entries alive
+        for ( const auto &entry : *this )
+            _invalidate( entry.name().data(), entry.name().size() );
+    }
+
+    // lookups of the directory go through the cache
+    void cache( std::shared_ptr< DentryCache > cache ) {
+        _cache = std::move( cache );
+    }
+
     size_t size() const override {
-        return _items.size();
+        return _indexed ? _index.size() : _items.size();
+    }
+
+    Node clone( const INode &origin ) const override {
+        return refcount::make< INode >( origin, *this );
     }
 
-    void create( utils::String name, Node inode ) {
+    void create( const utils::String &name, Node inode ) {
         if ( name.size() > FILE_NAME_LIMIT )
             throw Error( ENAMETOOLONG );
-        _insertItem( DirectoryEntry( std::move( name ), std::move( inode ) ) );
+        _insertItem( DirectoryEntry( _names->intern( name ), std::move( inode ) ) );
     }
 
     Node find( const utils::String &name ) {
-        auto position = _findItem( name );
-        if ( position == _items.end() || name != position->name() )
-            return Node();
-        return position->inode();
+        return find( name.data(), name.size() );
+    }
+
+    Node find( const char *name, size_t length ) {
+        Node node;
+        if ( !_cache ) {
+            if ( DirectoryEntry *entry = _findEntry( name, length ) )
+                node = entry->inode();
+            return node;
+        }
+
+        uint64_t key = DentryCache::key( _serial, name, length );
+        if ( _cache->find( key, _serial, name, length, node ) )
+            return node;
+        DirectoryEntry *entry = _findEntry( name, length );
+        if ( !entry )
+            _cache->insert( key, _serial, _names->intern( name, length ), node );
+        else if ( !entry->weak() ) {
+            node = entry->inode();
+            _cache->insert( key, _serial, entry->name(), node );
+        }
+        else
+            node = entry->inode();
+        return node;
     }
 
     void replaceEntry( const utils::String &name, Node node ) {
-        auto position = _findItem( name );
-        if ( position == _items.end() || name != position->name() )
+        DirectoryEntry *entry = _findEntry( name );
+        if ( !entry )
             throw Error( ENOENT );
-        *position = DirectoryEntry( name, node );
+        _invalidate( name.data(), name.size() );
+        *entry = DirectoryEntry( entry->name(), node );
     }
 
     template< typename T >
@@ -183,73 +406,172 @@ struct Directory : DataItem {
     }
 
     void remove( const utils::String &name ) {
-        auto position = _findItem( name );
-        if ( position == _items.end() || name != position->name() )
+        DirectoryEntry *entry = _findEntry( name );
+        if ( !entry )
             throw Error( ENOENT );
-        if ( position->inode()->mode().isDirectory() )
+        if ( entry->inode()->mode().isDirectory() )
             throw Error( EISDIR );
-        _items.erase( position );
+        _removeItem( name );
     }
 
     void removeDirectory( const utils::String &name ) {
-        auto position = _findItem( name );
-        if ( position == _items.end() || name != position->name() )
+        DirectoryEntry *entry = _findEntry( name );
+        if ( !entry )
             throw Error( ENOENT );
-        if ( !position->inode()->mode().isDirectory() )
+        if ( !entry->inode()->mode().isDirectory() )
             throw Error( ENOTDIR );
 
-        if ( position->inode()->size() != 2 )
+        if ( entry->inode()->size() != 2 )
             throw Error( ENOTEMPTY );
 
-        _items.erase( position );
+        _removeItem( name );
     }
 
     void forceRemove( const utils::String &name ) {
-        auto position = _findItem( name );
-        if ( position != _items.end() && name == position->name() )
-            _items.erase( position );
+        if ( _findEntry( name ) )
+            _removeItem( name );
+    }
+
+    // the first entry with a name greater than the given one, or the very first entry
+    const DirectoryEntry *after( const Name *name ) const {
+        if ( _indexed ) {
+            auto position = name ? _index.upper_bound( Key{ name->data(), name->size() } ) : _index.begin();
+            return position == _index.end() ? nullptr : &position->second;
+        }
+        auto position = !name ? _items.begin() : std::upper_bound(
+            _items.begin(),
+            _items.end(),
+            *name,
+            []( const Name &name, const DirectoryEntry &entry ) {
+                return entry.name().compare( name.data(), name.size() ) > 0;
+            } );
+        return position == _items.end() ? nullptr : &*position;
+    }
+
+    // the entry at the given position in the order of names
+    const DirectoryEntry *at( size_t position ) const {
+        if ( position >= size() )
+            return nullptr;
+        if ( _indexed )
+            return &std::next( _index.begin(), position )->second;
+        return &_items[ position ];
     }
 
-    Items::iterator begin() {
-        return _items.begin();
+    iterator begin() {
+        return _indexed ? iterator( _index.begin() ) : iterator( _items.begin() );
     }
-    Items::iterator end() {
-        return _items.end();
+    iterator end() {
+        return _indexed ? iterator( _index.end() ) : iterator( _items.end() );
     }
-    Items::const_iterator begin() const {
-        return _items.begin();
+    const_iterator begin() const {
+        return _indexed ? const_iterator( _index.begin() ) : const_iterator( _items.begin() );
     }
-    Items::const_iterator end() const {
-        return _items.end();
+    const_iterator end() const {
+        return _indexed ? const_iterator( _index.end() ) : const_iterator( _items.end() );
     }
 private:
 
     void _insertItem( DirectoryEntry &&entry ) {
-        auto position = _findItem( entry.name() );
-        if ( position == _items.end() ) {
-            _items.emplace_back( std::move( entry ) );
+        _invalidate( entry.name().data(), entry.name().size() );
+        if ( _indexed ) {
+            Key key = _key( entry );
+            auto position = _index.lower_bound( key );
+            if ( position != _index.end() && position->second.name() == entry.name() )
+                throw Error( EEXIST );
+            _index.emplace_hint( position, key, std::move( entry ) );
             return;
         }
-        if ( position->name() != entry.name() ) {
-            _items.insert( position, std::move( entry ) );
+
+        auto position = _findItem( entry.name().data(), entry.name().size() );
+        if ( position != _items.end() && position->name() == entry.name() )
+            throw Error( EEXIST );
+        _items.insert( position, std::move( entry ) );
+
+        if ( _items.size() > DIRECTORY_INDEX_THRESHOLD )
+            _buildIndex();
+    }
+
+    void _removeItem( const utils::String &name ) {
+        _invalidate( name.data(), name.size() );
+        if ( !_indexed ) {
+            _items.erase( _findItem( name ) );
             return;
         }
-        throw Error( EEXIST );
+        _index.erase( Key{ name.data(), name.size() } );
+        // some slack so that the directory does not switch back and forth
+        if ( _index.size() < DIRECTORY_INDEX_THRESHOLD / 2 )
+            _dropIndex();
+    }
+
+    DirectoryEntry *_findEntry( const utils::String &name ) {
+        return _findEntry( name.data(), name.size() );
+    }
+
+    DirectoryEntry *_findEntry( const char *name, size_t length ) {
+        if ( _indexed ) {
+            auto position = _index.find( Key{ name, length } );
+            return position == _index.end() ? nullptr : &position->second;
+        }
+        auto position = _findItem( name, length );
+        if ( position == _items.end() || position->name().compare( name, length ) )
+            return nullptr;
+        return &*position;
     }
 
     Items::iterator _findItem( const utils::String &name ) {
+        return _findItem( name.data(), name.size() );
+    }
+
+    Items::iterator _findItem( const char *name, size_t length ) {
         return std::lower_bound(
             _items.begin(),
             _items.end(),
             name,
-            []( const DirectoryEntry &entry, const utils::String &name ) {
-                return entry.name() < name;
+            [length]( const DirectoryEntry &entry, const char *name ) {
+                return entry.name().compare( name, length ) < 0;
             } );
     }
 
+    void _invalidate( const char *name, size_t length ) {
+        if ( _cache )
+            _cache->invalidate( _serial, name, length );
+    }
+
+    static uint64_t _nextSerial() {
+        static uint64_t serial = 0;
+        return ++serial;
+    }
+
+    // the key points to the text of the name, which stays in place when the entry moves
+    static Key _key( const DirectoryEntry &entry ) {
+        return Key{ entry.name().data(), entry.name().size() };
+    }
+
+    void _buildIndex() {
+        for ( auto &entry : _items )
+            _index.emplace_hint( _index.end(), _key( entry ), std::move( entry ) );
+        Items().swap( _items );
+        _indexed = true;
+    }
+
+    void _dropIndex() {
+        _items.reserve( _index.size() );
+        for ( auto &entry : _index )
+            _items.emplace_back( std::move( entry.second ) );
+        Index().swap( _index );
+        _indexed = false;
+    }
+
     Items _items;
+    Index _index;
+    bool _indexed;
+    uint64_t _serial;
+    std::shared_ptr< DentryCache > _cache;
+    std::shared_ptr< NameTable > _names;
 };
 
+static_assert( sizeof( Directory ) <= INode::INLINE_SIZE, "directories are stored inline" );
+
 } // namespace fs
 } // namespace divine
 
@@ -5,7 +5,9 @@
 
 #include "fs-utils.h"
 #include "fs-inode.h"
+#include "fs-name.h"
 #include "fs-storage.h"
+#include "fs-constants.h"
 
 #ifndef _FS_FILE_H_
 #define _FS_FILE_H_
@@ -19,8 +21,10 @@ enum MemoryType{
 };
 
 struct Link : DataItem {
+    static const unsigned short KIND = DataKind::Link;
 
     Link( utils::String target ) :
+        DataItem( KIND ),
         _target( std::move( target ) )
     {
         if ( _target.size() > PATH_LIMIT )
@@ -31,6 +35,10 @@ struct Link : DataItem {
         return _target.size();
     }
 
+    Node clone( const INode &origin ) const override {
+        return refcount::make< INode >( origin, *this );
+    }
+
     const utils::String &target() const {
         return _target;
     }
@@ -40,6 +48,7 @@ private:
 };
 
 struct File : DataItem {
+    static const unsigned short KIND = DataKind::File;
 
     virtual bool read( char *, size_t, size_t & ) = 0;
     virtual bool write( const char *, size_t, size_t & ) = 0;
@@ -48,30 +57,39 @@ struct File : DataItem {
     virtual bool canRead() const = 0;
     virtual bool canWrite() const = 0;
 
+protected:
+    explicit File( unsigned short kind ) :
+        DataItem( kind )
+    {}
 };
 
-struct RegularFile : File {
+struct RegularFile final : File {
+    static const unsigned short KIND = DataKind::RegularFile;
 
     RegularFile( const char *content, size_t size ) :
-        _snapshot( bool( content ) ),
-        _size( content ? size : 0 ),
-        _roContent( content ),
-        count(0)
+        File( KIND ),
+        _content( FILE_CHUNK_SIZE, content, content ? size : 0 )
     {}
 
     RegularFile() :
-        _snapshot( false ),
-        _size( 0 ),
-        _roContent( nullptr ),
-        count(0)
+        File( KIND ),
+        _content( FILE_CHUNK_SIZE )
     {}
 
-    RegularFile( const RegularFile &other ) = default;
+    // mappings stay with the original, the copy gets the bytes only
+    RegularFile( const RegularFile &other ) :
+        File( other ),
+        _content( other._content )
+    {}
     RegularFile( RegularFile &&other ) = default;
     RegularFile &operator=( RegularFile ) = delete;
 
     size_t size() const override {
-        return _size;
+        return _content.size();
+    }
+
+    Node clone( const INode &origin ) const override {
+        return refcount::make< INode >( origin, *this );
     }
 
     bool canRead() const override {
@@ -82,80 +100,79 @@ struct RegularFile : File {
     }
 
     bool read( char *buffer, size_t offset, size_t &length ) override {
-        if ( offset >= _size ) {
-            length = 0;
-            return true;
-        }
-        const char *source = _isSnapshot() ?
-                          _roContent + offset :
-                          _content.data() + offset;
-        if ( offset + length > _size )
-            length = _size - offset;
-        std::copy( source, source + length, buffer );
+        length = _content.read( buffer, offset, length );
         return true;
     }
 
     bool write( const char *buffer, size_t offset, size_t &length ) override {
-        if ( count ) {
-            throw Error( EBUSY );
-        }
-        if ( _isSnapshot() )
-            _copyOnWrite();
-
-        if ( _content.size() < offset + length )
-            resize( offset + length );
-
-        std::copy( buffer, buffer + length, _content.begin() + offset );
+        _content.write( buffer, offset, length );
         return true;
     }
 
     void clear() override {
-        if ( !_size )
-            return;
-
-        _snapshot = false;
         resize( 0 );
     }
 
     void resize( size_t length ) {
         _content.resize( length );
-        _size = _content.size();
     }
 
-    char* getPtr(size_t offset)  {
-        return &_content[offset];
+    size_t seekData( size_t offset ) const {
+        size_t position = offset < size() ? _content.nextData( offset ) : size();
+        if ( position == size() )
+            throw Error( ENXIO );
+        return position;
     }
 
-    void unlockWrite() {
-        --count;
+    size_t seekHole( size_t offset ) const {
+        if ( offset >= size() )
+            throw Error( ENXIO );
+        return _content.nextHole( offset );
     }
 
-    void lockWrite() {
-        ++count;
+    // full chunks of the file are deduplicated through the store
+    void blocks( std::shared_ptr< storage::BlockStore > store ) {
+        _content.store( std::move( store ) );
     }
 
-private:
+    storage::Chunks::Saved save( size_t offset, size_t length ) const {
+        return _content.save( offset, length );
+    }
 
-    bool _isSnapshot() const {
-        return _snapshot;
+    void restore( const storage::Chunks::Saved &saved ) {
+        _content.restore( saved );
     }
 
-    void _copyOnWrite() {
-        const char *roContent = _roContent;
-        _content.resize( _size );
+    /*
+     * Buffer of a shared mapping. Reads and writes of the covered range go
+     * through the buffer, which stays in place however the file is resized.
+     * Buffers of overlapping ranges which do not nest exchange the changes
+     * made through them at syncPtr(), see storage::Chunks.
+     */
+    char *getPtr( size_t offset, size_t length ) {
+        return _content.pin( offset, length );
+    }
 
-        std::copy( roContent, roContent + _size, _content.begin() );
-        _snapshot = false;
+    void syncPtr( const char *ptr ) {
+        _content.sync( ptr );
     }
 
-    bool _snapshot;
-    size_t _size;
-    const char *_roContent;
-    utils::Vector< char > _content;
-    int count;
+    void releasePtr( const char *ptr ) {
+        _content.unpin( ptr );
+    }
+
+private:
+    storage::Chunks _content;
 };
 
+static_assert( sizeof( RegularFile ) <= INode::INLINE_SIZE, "regular files are stored inline" );
+
 struct WriteOnlyFile : File {
+    static const unsigned short KIND = DataKind::WriteOnlyFile;
+
+    WriteOnlyFile() :
+        File( KIND )
+    {}
 
     size_t size() const override {
         return 0;
@@ -177,12 +194,16 @@ struct WriteOnlyFile : File {
 };
 
 struct StandardInput : File {
+    static const unsigned short KIND = DataKind::StandardInput;
+
     StandardInput() :
+        File( KIND ),
         _content( nullptr ),
         _size( 0 )
     {}
 
     StandardInput( const char *content, size_t size ) :
+        File( KIND ),
         _content( content ),
         _size( size )
     {}
@@ -223,14 +244,17 @@ private:
 };
 
 struct Pipe : File {
+    static const unsigned short KIND = DataKind::Pipe;
 
     Pipe() :
+        File( KIND ),
         _stream( PIPE_SIZE_LIMIT ),
         _reader( false ),
         _writer( false )
     {}
 
     Pipe( bool r, bool w ) :
+        File( KIND ),
         _stream( PIPE_SIZE_LIMIT ),
         _reader( r ),
         _writer( w )
@@ -307,6 +331,7 @@ private:
 };
 
 struct Socket : File {
+    static const unsigned short KIND = DataKind::Socket;
 
     struct Address {
 
@@ -315,7 +340,12 @@ struct Socket : File {
             _valid( false )
         {}
 
-        explicit Address( utils::String value, bool anonymous = false ) :
+        explicit Address( const utils::String &value, bool anonymous = false ) :
+            _value( value.data(), value.size() ),
+            _anonymous( anonymous ),
+            _valid( true )
+        {}
+        explicit Address( Name value, bool anonymous = false ) :
             _value( std::move( value ) ),
             _anonymous( anonymous ),
             _valid( true )
@@ -328,7 +358,7 @@ struct Socket : File {
             return *this;
         }
 
-        const utils::String &value() const {
+        const Name &value() const {
             return _value;
         }
 
@@ -368,7 +398,7 @@ struct Socket : File {
         }
 
     private:
-        utils::String _value;
+        Name _value;
         bool _anonymous;
         bool _valid;
     };
@@ -424,6 +454,10 @@ struct Socket : File {
         abort();
     }
 protected:
+    explicit Socket( unsigned short kind ) :
+        File( kind )
+    {}
+
     virtual void abort() = 0;
 private:
     Address _address;
@@ -435,8 +469,10 @@ inline void swap( Socket::Address &lhs, Socket::Address &rhs ) {
 }
 
 struct SocketStream : Socket {
+    static const unsigned short KIND = DataKind::SocketStream;
 
     SocketStream() :
+        Socket( KIND ),
         _peer( nullptr ),
         _stream( 1024 ),
         _passive( false ),
@@ -445,6 +481,7 @@ struct SocketStream : Socket {
     {}
 
     SocketStream( Node partner ) :
+        Socket( KIND ),
         _peerHandle( std::move( partner ) ),
         _peer( _peerHandle->data()->as< SocketStream >() ),
         _stream( 1024 ),
@@ -491,11 +528,8 @@ struct SocketStream : Socket {
             if ( !m->canConnect() )
                 throw Error( ECONNREFUSED );
 
-            _peerHandle = std::allocate_shared< INode >(
-                memory::AllocatorPure(),
-                Mode::GRANTS,
-                _peer = new( memory::nofail ) SocketStream( self )
-            );
+            _peerHandle = refcount::make< INode >( Mode::GRANTS );
+            _peer = _peerHandle->emplace< SocketStream >( self );
 
             m->addBacklog( _peerHandle );
         }
@@ -592,8 +626,10 @@ private:
 };
 
 struct SocketDatagram : Socket {
+    static const unsigned short KIND = DataKind::SocketDatagram;
 
-    SocketDatagram()
+    SocketDatagram() :
+        Socket( KIND )
     {}
 
     Socket &peer() override {
@@ -728,26 +764,27 @@ private:
 
 struct Memory {
 
-    Memory(Flags <flags::Mapping> flags, size_t length, size_t offset, File *target) : offset( offset ) {
+    Memory(Flags <flags::Mapping> flags, size_t length, size_t offset, Node target) :
+        type( Private ),
+        memory( nullptr )
+    {
         if ( flags.has(flags::Mapping::MapAnon )) {
-            type = Private;
             memory = new( memory::nofail ) char[length]();
             if ( memory == nullptr ) {
                 throw Error(ENOMEM);
             }
         } else {
-            file = target->as<RegularFile>();
-            if ( !file ) {
+            RegularFile *regular = target->data()->as<RegularFile>();
+            if ( !regular ) {
                 return;
             }
             if ( flags.has( flags::Mapping::MapPrivate )) {
-                type = Private;
                 memory = new(memory::nofail) char[length];
-                char *dst = reinterpret_cast< char * >( memory );
-                target->read(dst, offset, length);
+                regular->read(memory, offset, length);
             } else {
                 type = Shared;
-                file->lockWrite();
+                memory = regular->getPtr( offset, length );
+                inode = std::move( target );
             }
         }
     }
@@ -756,10 +793,18 @@ struct Memory {
     Memory &operator=(const Memory &) = delete;
 
     void *getPtr() const {
-        if ( type == Private ) {
-            return memory;
-        }
-        return file ? file->getPtr( offset ) : nullptr;
+        return memory;
+    }
+
+    // mapped file of a shared mapping
+    Node node() const {
+        return inode;
+    }
+
+    // msync(), other mappings of the file see what was stored through this one
+    void sync() {
+        if ( type == Shared )
+            inode->data()->as<RegularFile>()->syncPtr( memory );
     }
 
     ~Memory() {
@@ -767,17 +812,15 @@ struct Memory {
             delete[] memory;
         }
         if ( type == Shared ) {
-            file->unlockWrite();
+            RegularFile *file = inode->data()->as<RegularFile>();
+            file->releasePtr( memory );
         }
     }
 
 private:
     MemoryType type;
-    size_t offset;
-    union{
-        void *memory;
-        RegularFile *file;
-    };
+    char *memory;
+    Node inode;
 };
 
 } // namespace fs
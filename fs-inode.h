@@ -1,8 +1,12 @@
 // -*- C++ -*- (c) 2015 Jiří Weiser
 
 #include <memory>
+#include <cstddef>
+#include <type_traits>
 
 #include "sys/types.h"
+#include "fs-memory.h"
+#include "fs-refcount.h"
 
 #ifndef _FS_INODE_H_
 #define _FS_INODE_H_
@@ -130,41 +134,128 @@ private:
     mode_t _mode;
 };
 
+/*
+ * Kinds of data items, used for downcasts instead of RTTI. The tag of a kind
+ * contains the bits of all kinds it is derived from, so DataItem::as() is a
+ * single mask test.
+ */
+struct DataKind {
+    enum : unsigned short {
+        Link            = 1 << 0,
+        Directory       = 1 << 1,
+        File            = 1 << 2,
+        RegularFile     = 1 << 3 | File,
+        WriteOnlyFile   = 1 << 4 | File,
+        StandardInput   = 1 << 5 | File,
+        Pipe            = 1 << 6 | File,
+        Socket          = 1 << 7 | File,
+        SocketStream    = 1 << 8 | Socket,
+        SocketDatagram  = 1 << 9 | Socket
+    };
+};
+
+struct INode;
+
+using Node = refcount::Strong< INode >;
+using WeakNode = refcount::Weak< INode >;
+
 struct DataItem {
     virtual ~DataItem() {}
 
     virtual size_t size() const = 0;
 
+    // returns a private copy of the origin holding a copy of this item; items
+    // which cannot be copied (pipes, sockets) return nullptr and stay shared
+    // between clones of the file system
+    virtual Node clone( const INode & ) const {
+        return nullptr;
+    }
+
+    unsigned short kind() const {
+        return _kind;
+    }
+
+    template< typename T >
+    bool is() const {
+        return ( _kind & T::KIND ) == T::KIND;
+    }
+
     template< typename T >
     T *as() {
-        return dynamic_cast< T * >( this );
+        return is< T >() ? static_cast< T * >( this ) : nullptr;
     }
 
     template< typename T >
     const T *as() const {
-        return dynamic_cast< const T * >( this );
+        return is< T >() ? static_cast< const T * >( this ) : nullptr;
     }
+
+protected:
+    explicit DataItem( unsigned short kind ) :
+        _kind( kind )
+    {}
+
+private:
+    unsigned short _kind;
 };
 
-using Handle = std::unique_ptr< DataItem >;
 using Ptr = DataItem *;
 using ConstPtr = const DataItem *;
 
-struct INode {
+/*
+ * The data item is stored inline when it fits, so that the common kinds
+ * (regular files, directories, links, pipes) need a single allocation
+ * together with the node; larger items (sockets) overflow to the heap.
+ * Nodes are counted intrusively, see fs-refcount.h.
+ */
+struct INode : refcount::Counted< memory::Category::Nodes > {
+    static const size_t INLINE_SIZE = 18 * sizeof( void * );
 
-    INode( mode_t mode, Ptr data = nullptr ) :
+    INode( mode_t mode ) :
         _mode( mode ),
         _ino( getIno() ),
         _uid( 0 ),
         _gid( 0 ),
-        _data( data )
+        _generation( 0 ),
+        _links( 0 ),
+        _inline( false ),
+        _data( nullptr )
     {}
 
-    bool assign( Ptr item ) {
+    // private copy of the other inode holding a copy of its item, keeps its
+    // inode number
+    template< typename T >
+    INode( const INode &other, const T &item ) :
+        _mode( other._mode ),
+        _ino( other._ino ),
+        _uid( other._uid ),
+        _gid( other._gid ),
+        _generation( other._generation ),
+        _links( other._links ),
+        _inline( false ),
+        _data( nullptr )
+    {
+        emplace< T >( item );
+    }
+
+    INode( const INode & ) = delete;
+    INode &operator=( const INode & ) = delete;
+
+    ~INode() {
+        dispose();
+    }
+
+    // constructs the data item of the node, returns nullptr if it has one
+    template< typename T, typename... Args >
+    T *emplace( Args &&... args ) {
         if ( _data )
-            return false;
-        _data.reset( item );
-        return true;
+            return nullptr;
+
+        using Fits = std::integral_constant< bool, _fits< T >() >;
+        T *item = _construct< T >( Fits(), std::forward< Args >( args )... );
+        _inline = Fits::value;
+        _data = item;
+        return item;
     }
 
     unsigned ino() const {
@@ -189,23 +280,72 @@ struct INode {
         return _gid;
     }
 
+    unsigned generation() const {
+        return _generation;
+    }
+    void generation( unsigned g ) {
+        _generation = g;
+    }
+
+    // number of directory entries naming the node, including "." and ".."
+    nlink_t links() const {
+        return _links;
+    }
+    void links( nlink_t l ) {
+        _links = l;
+    }
+
     Ptr data() {
-        return _data.get();
+        return _data;
     }
     ConstPtr data() const {
-        return _data.get();
+        return _data;
     }
 
     explicit operator bool() const {
-        return bool( _data );
+        return _data != nullptr;
     }
 
 private:
+    friend struct refcount::Strong< INode >;
+
+    // the item goes away with the last strong handle, the node itself stays
+    // until the last weak one
+    void dispose() {
+        if ( _inline )
+            _data->~DataItem();
+        else
+            delete _data;
+        _data = nullptr;
+        _inline = false;
+    }
+
+    using Storage = typename std::aligned_storage< INLINE_SIZE, alignof( std::max_align_t ) >::type;
+
+    template< typename T >
+    static constexpr bool _fits() {
+        return sizeof( T ) <= sizeof( Storage ) && alignof( T ) <= alignof( Storage );
+    }
+
+    template< typename T, typename... Args >
+    T *_construct( std::true_type, Args &&... args ) {
+        return new( &_storage ) T( std::forward< Args >( args )... );
+    }
+
+    template< typename T, typename... Args >
+    T *_construct( std::false_type, Args &&... args ) {
+        return new( memory::nofail ) T( std::forward< Args >( args )... );
+    }
+
     Mode _mode;
     unsigned _ino;
     unsigned _uid;
     unsigned _gid;
-    Handle _data;
+    unsigned _generation;
+    nlink_t _links;
+    bool _inline;
+    Ptr _data;
+    Storage _storage;
 
     static unsigned getIno() {
         static unsigned ino = 0;
@@ -213,9 +353,6 @@ private:
     }
 };
 
-using Node = std::shared_ptr< INode >;
-using WeakNode = std::weak_ptr< INode >;
-
 } // namespace fs
 } // namespace divine
 
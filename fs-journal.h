@@ -0,0 +1,91 @@
+// -*- C++ -*- (c) 2015 Jiří Weiser
+
+#include <memory>
+
+#include "fs-utils.h"
+
+#ifndef _FS_JOURNAL_H_
+#define _FS_JOURNAL_H_
+
+namespace divine {
+namespace fs {
+
+/*
+ * Log of inverse operations. Recording starts with the first checkpoint;
+ * rolling back to a mark undoes the changes made since the mark in reverse
+ * order, so its cost depends only on the number of those changes.
+ */
+struct Journal {
+    using Mark = size_t;
+
+    Journal() :
+        _recording( false )
+    {}
+
+    Journal( const Journal & ) = delete;
+    Journal &operator=( const Journal & ) = delete;
+
+    bool recording() const {
+        return _recording;
+    }
+
+    Mark checkpoint() {
+        _recording = true;
+        return _undo.size();
+    }
+
+    template< typename Undo >
+    void record( Undo &&undo ) {
+        if ( !_recording )
+            return;
+        _undo.emplace_back( new( memory::nofail ) Action< typename std::decay< Undo >::type >(
+            std::forward< Undo >( undo ) ) );
+    }
+
+    void rollback( Mark mark ) {
+        if ( mark > _undo.size() )
+            throw Error( EINVAL );
+
+        // the inverse operations must not be recorded themselves
+        _recording = false;
+        auto d = utils::make_defer( [&]{ _recording = true; } );
+        while ( _undo.size() > mark ) {
+            std::unique_ptr< ActionBase > action( std::move( _undo.back() ) );
+            _undo.pop_back();
+            action->undo();
+        }
+    }
+
+    // forgets all marks and stops recording
+    void commit() {
+        _undo.clear();
+        _recording = false;
+    }
+
+private:
+    struct ActionBase {
+        virtual ~ActionBase() {}
+        virtual void undo() = 0;
+    };
+
+    template< typename Undo >
+    struct Action : ActionBase {
+        Action( Undo undo ) :
+            _undo( std::move( undo ) )
+        {}
+
+        void undo() override {
+            _undo();
+        }
+    private:
+        Undo _undo;
+    };
+
+    utils::Vector< std::unique_ptr< ActionBase > > _undo;
+    bool _recording;
+};
+
+} // namespace fs
+} // namespace divine
+
+#endif
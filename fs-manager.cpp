@@ -6,7 +6,7 @@
     WeakNode savedDir = _currentDirectory;                              \
     auto d = utils::make_defer( [&]{ _currentDirectory = savedDir; } ); \
     if ( path::isRelative( name ) && dirfd != CURRENT_DIRECTORY )       \
-        changeDirectory( dirfd );                                       \
+        _currentDirectory = _directory( dirfd );                        \
     else                                                                \
         d.pass();
 
@@ -14,28 +14,86 @@ namespace divine {
 namespace fs {
 
 Manager::Manager( bool ) :
-    _root{ std::allocate_shared< INode >(
-        memory::AllocatorPure(), Mode::DIR | Mode::GRANTS
-    ) },
-    _currentDirectory{ _root },
-    _standardIO{ {
-        std::allocate_shared< INode >( memory::AllocatorPure(), Mode::FILE | Mode::RUSER ),
-        std::allocate_shared< INode >( memory::AllocatorPure(), Mode::FILE | Mode::RUSER )
-    } },
-    _openFD{
-        std::allocate_shared< FileDescriptor >( memory::AllocatorPure(), _standardIO[ 0 ], flags::Open::Read ),// stdin
-        std::allocate_shared< FileDescriptor >( memory::AllocatorPure(), _standardIO[ 1 ], flags::Open::Write ),// stdout
-        std::allocate_shared< FileDescriptor >( memory::AllocatorPure(), _standardIO[ 1 ], flags::Open::Write )// stderr
-    },
-    _umask{ Mode::WGROUP | Mode::WOTHER }
+    _arena{ memory::Arena::create() },
+    _generation{ _nextGeneration() },
+    _openFD( FILE_DESCRIPTOR_LIMIT ),
+    _umask{ Mode::WGROUP | Mode::WOTHER },
+    _blocks{ std::allocate_shared< storage::BlockStore >( memory::AllocatorPure() ) },
+    _dentries{ std::allocate_shared< DentryCache >( memory::AllocatorPure() ) },
+    _names{ std::allocate_shared< NameTable >( memory::AllocatorPure() ) }
 {
-    _root->assign( new( memory::nofail ) Directory( _root ) );
-    _standardIO[ 1 ]->assign( new( memory::nofail ) WriteOnlyFile() );
+    ArenaScope scope( this );
+    // the nodes are allocated only now that the arena is current
+    _root = _allocateNode( Mode::DIR | Mode::GRANTS );
+    _currentDirectory = _root;
+    _standardIO[ 0 ] = _allocateNode( Mode::FILE | Mode::RUSER );
+    _standardIO[ 1 ] = _allocateNode( Mode::FILE | Mode::RUSER );
+    _openFD.set( 0, std::allocate_shared< FileDescriptor >( DescriptorAllocator(), _standardIO[ 0 ], flags::Open::Read ) );// stdin
+    _openFD.set( 1, std::allocate_shared< FileDescriptor >( DescriptorAllocator(), _standardIO[ 1 ], flags::Open::Write ) );// stdout
+    _openFD.set( 2, std::allocate_shared< FileDescriptor >( DescriptorAllocator(), _standardIO[ 1 ], flags::Open::Write ) );// stderr
+    _root->emplace< Directory >( _root, WeakNode(), _names );
+    _root->links( 2 );
+    _root->data()->as< Directory >()->cache( _dentries );
+    _standardIO[ 1 ]->emplace< WriteOnlyFile >();
+}
+
+Manager::Manager( Manager &source ) :
+    _arena{ source._arena },
+    _generation{ _nextGeneration() },
+    _root{ source._root },
+    _currentDirectory{ source._currentDirectory },
+    _standardIO( source._standardIO ),
+    _openFD( source._openFD.limit() ),
+    _umask{ source._umask },
+    _detached( source._detached ),
+    _blocks( source._blocks ),
+    _dentries( source._dentries ),
+    _names( source._names )
+{
+    ArenaScope scope( this );
+    // descriptors shared by dup() stay shared within the clone
+    utils::UnorderedMap< FileDescriptor *, std::shared_ptr< FileDescriptor > > copies;
+    source._openFD.forEach( [&]( int i, const std::shared_ptr< FileDescriptor > &fd ) {
+        // pipes and sockets are shared, so are their descriptors
+        if ( !fd->inode() || fd->inode()->mode().isFifo() || fd->inode()->mode().isSocket() ) {
+            _openFD.set( i, fd );
+            return;
+        }
+        auto &copy = copies[ fd.get() ];
+        if ( !copy )
+            copy = std::allocate_shared< FileDescriptor >( DescriptorAllocator(), *fd );
+        _openFD.set( i, copy );
+    } );
+}
+
+std::unique_ptr< Manager > Manager::clone() {
+    ArenaScope scope( this );
+    std::unique_ptr< Manager > result( new( memory::nofail ) Manager( *this ) );
+
+    // everything reachable so far is shared now, both sides copy on write
+    _generation = _nextGeneration();
+
+    // mapped files have to stay with this manager, the clone gets a copy
+    for ( const auto &region : _mappings ) {
+        for ( const auto &m : region.second.memory ) {
+            Node original = m->node();
+            // one copy for all mappings of the file
+            if ( !original || result->_resolve( original ) != original )
+                continue;
+            Node copy = original->data()->clone( *original );
+            copy->generation( result->_generation );
+            // the mapped buffer keeps changing, descriptors of the clone follow the copy
+            result->_detached.set( original->ino(), copy );
+            original->generation( _generation );
+        }
+    }
+    return result;
 }
 
 
 template< typename... Args >
 Node Manager::createNodeAt( int dirfd, utils::String name, mode_t mode, Args &&... args ) {
+    ArenaScope scope( this );
     if ( name.empty() )
         throw Error( ENOENT );
 
@@ -45,29 +103,32 @@ Node Manager::createNodeAt( int dirfd, utils::String name, mode_t mode, Args &&.
     std::tie( current, name ) = _findDirectoryOfFile( name );
 
     _checkGrants( current, Mode::WUSER );
+    current = _writable( current );
     Directory *dir = current->data()->as< Directory >();
 
     mode &= ~umask() & ( Mode::TMASK | Mode::GRANTS );
     if ( Mode( mode ).isDirectory() )
         mode |= Mode::GUID;
 
-    Node node = std::allocate_shared< INode >( memory::AllocatorPure(), mode );
+    Node node = _allocateNode( mode );
 
     switch( mode & Mode::TMASK ) {
     case Mode::SOCKET:
-        node->assign( utils::constructIfPossible< SocketDatagram >( std::forward< Args >( args )... ) );
+        utils::emplaceIfPossible< SocketDatagram >( *node, std::forward< Args >( args )... );
         break;
     case Mode::LINK:
-        node->assign( utils::constructIfPossible< Link >( std::forward< Args >( args )... ) );
+        utils::emplaceIfPossible< Link >( *node, std::forward< Args >( args )... );
         break;
     case Mode::FILE:
-        node->assign( utils::constructIfPossible< RegularFile >( std::forward< Args >( args )... ) );
+        if ( RegularFile *file = utils::emplaceIfPossible< RegularFile >( *node, std::forward< Args >( args )... ) )
+            file->blocks( _blocks );
         break;
     case Mode::DIR:
-        node->assign( utils::constructIfPossible< Directory >( node, current ) );
+        if ( Directory *d = utils::emplaceIfPossible< Directory >( *node, node, current, _names ) )
+            d->cache( _dentries );
         break;
     case Mode::FIFO:
-        node->assign( utils::constructIfPossible< Pipe >( std::forward< Args >( args )... ) );
+        utils::emplaceIfPossible< Pipe >( *node, std::forward< Args >( args )... );
         break;
     case Mode::BLOCKD:
     case Mode::CHARD:
@@ -78,12 +139,21 @@ Node Manager::createNodeAt( int dirfd, utils::String name, mode_t mode, Args &&.
     if ( !node->data() )
         throw Error( EINVAL );
 
+    _recordEntry( current, name );
     dir->create( std::move( name ), node );
 
+    if ( node->mode().isDirectory() ) {
+        node->links( 2 );
+        _changeLinks( current, 1 );
+    }
+    else
+        node->links( 1 );
+
     return node;
 }
 
 void Manager::createHardLinkAt( int newdirfd, utils::String name, int olddirfd, const utils::String &target, Flags< flags::At > fl ) {
+    ArenaScope scope( this );
     if ( name.empty() || target.empty() )
         throw Error( ENOENT );
 
@@ -97,6 +167,7 @@ void Manager::createHardLinkAt( int newdirfd, utils::String name, int olddirfd,
     }
 
     _checkGrants( current, Mode::WUSER );
+    current = _writable( current );
     Directory *dir = current->data()->as< Directory >();
 
     Node targetNode;
@@ -110,10 +181,14 @@ void Manager::createHardLinkAt( int newdirfd, utils::String name, int olddirfd,
     if ( targetNode->mode().isDirectory() )
         throw Error( EPERM );
 
+    targetNode = _writable( targetNode );
+    _recordEntry( current, name );
     dir->create( std::move( name ), targetNode );
+    _changeLinks( targetNode, 1 );
 }
 
 void Manager::createSymLinkAt( int dirfd, utils::String name, utils::String target ) {
+    ArenaScope scope( this );
     if ( name.empty() )
         throw Error( ENOENT );
     if ( target.size() > PATH_LIMIT )
@@ -126,10 +201,11 @@ void Manager::createSymLinkAt( int dirfd, utils::String name, utils::String targ
     createNodeAt( dirfd, std::move( name ), mode, std::move( target ) );
 }
 
-ssize_t Manager::readLinkAt( int dirfd, utils::String name, char *buf, size_t count ) {
+ssize_t Manager::readLinkAt( int dirfd, path::View name, char *buf, size_t count ) {
+    ArenaScope scope( this );
     REMEMBER_DIRECTORY( dirfd, name );
 
-    Node inode = findDirectoryItem( std::move( name ), false );
+    Node inode = findDirectoryItem( name, false );
     if ( !inode )
         throw Error( ENOENT );
     if ( !inode->mode().isLink() )
@@ -142,55 +218,77 @@ ssize_t Manager::readLinkAt( int dirfd, utils::String name, char *buf, size_t co
     return realLength;
 }
 
-void Manager::accessAt( int dirfd, utils::String name, Flags< flags::Access > mode, Flags< flags::At > fl ) {
+void Manager::accessAt( int dirfd, path::View name, Flags< flags::Access > mode, Flags< flags::At > fl ) {
+    ArenaScope scope( this );
+    tryAccessAt( dirfd, name, mode, fl ).value();
+}
+
+Result< void > Manager::tryAccessAt( int dirfd, path::View name, Flags< flags::Access > mode, Flags< flags::At > fl ) {
+    ArenaScope scope( this );
     if ( name.empty() )
-        throw Error( ENOENT );
+        return Error( ENOENT );
 
     if ( mode.has( flags::Access::Invalid ) ||
         fl.has( flags::At::Invalid ) )
-        throw Error( EINVAL );
+        return Error( EINVAL );
 
     REMEMBER_DIRECTORY( dirfd, name );
 
-    Node item = findDirectoryItem( name, !fl.has( flags::At::SymNofollow ) );
+    auto item = tryFindDirectoryItem( name, !fl.has( flags::At::SymNofollow ) );
     if ( !item )
-        throw Error( ENOENT );
+        return Error( item.error() );
+    if ( !*item )
+        return Error( ENOENT );
+
+    if ( ( mode.has( flags::Access::Read ) && !( *item )->mode().userRead() ) ||
+         ( mode.has( flags::Access::Write ) && !( *item )->mode().userWrite() ) ||
+         ( mode.has( flags::Access::Execute ) && !( *item )->mode().userExecute() ) )
+        return Error( EACCES );
+    return {};
+}
 
-    if ( ( mode.has( flags::Access::Read ) && !item->mode().userRead() ) ||
-         ( mode.has( flags::Access::Write ) && !item->mode().userWrite() ) ||
-         ( mode.has( flags::Access::Execute ) && !item->mode().userExecute() ) )
-        throw Error( EACCES );
+int Manager::openFileAt( int dirfd, path::View name, Flags< flags::Open > fl, mode_t mode ) {
+    ArenaScope scope( this );
+    return tryOpenFileAt( dirfd, name, fl, mode ).value();
 }
 
-int Manager::openFileAt( int dirfd, utils::String name, Flags< flags::Open > fl, mode_t mode ) {
+Result< int > Manager::tryOpenFileAt( int dirfd, path::View name, Flags< flags::Open > fl, mode_t mode ) {
+    ArenaScope scope( this );
     REMEMBER_DIRECTORY( dirfd, name );
 
-    Node file = findDirectoryItem( name, !fl.has( flags::Open::SymNofollow ) );
+    auto found = tryFindDirectoryItem( name, !fl.has( flags::Open::SymNofollow ) );
+    if ( !found )
+        return Error( found.error() );
+    Node file = *found;
 
     if ( fl.has( flags::Open::Create ) ) {
         if ( file ) {
             if ( fl.has( flags::Open::Excl ) )
-                throw Error( EEXIST );
+                return Error( EEXIST );
         }
         else {
-            file = createNodeAt( CURRENT_DIRECTORY, std::move( name ), mode | Mode::FILE );
+            file = createNodeAt( CURRENT_DIRECTORY, name.str(), mode | Mode::FILE );
         }
     }
     else if ( !file )
-        throw Error( ENOENT );
+        return Error( ENOENT );
 
     if ( file->mode().isSocket() || file->mode().isCharacterDevice() || file->mode().isBlockDevice() )
-        throw Error( ENXIO );
+        return Error( ENXIO );
 
-    if ( fl.has( flags::Open::Read ) )
-        _checkGrants( file, Mode::RUSER );
+    if ( fl.has( flags::Open::Read ) && !_hasGrants( file, Mode::RUSER ) )
+        return Error( EACCES );
     if ( fl.has( flags::Open::Write ) ) {
-        _checkGrants( file, Mode::WUSER );
+        if ( !_hasGrants( file, Mode::WUSER ) )
+            return Error( EACCES );
         if ( file->mode().isDirectory() )
-            throw Error( EISDIR );
-        if ( fl.has( flags::Open::Truncate ) )
+            return Error( EISDIR );
+        if ( fl.has( flags::Open::Truncate ) ) {
+            file = _writable( file );
+            _recordContent( file, 0, file->size() );
             if ( auto f = file->data()->as< File >() )
                 f->clear();
+        }
     }
 
     if ( fl.has( flags::Open::NoAccess ) ) {
@@ -199,55 +297,139 @@ int Manager::openFileAt( int dirfd, utils::String name, Flags< flags::Open > fl,
     }
 
     if ( file->mode().isFifo() )
-        return _getFileDescriptor( std::allocate_shared< PipeDescriptor >( memory::AllocatorPure(), file, fl, true ) );
-    return _getFileDescriptor( std::allocate_shared< FileDescriptor >( memory::AllocatorPure(), file, fl ) );
+        return _getFileDescriptor( std::allocate_shared< PipeDescriptor >( DescriptorAllocator(), file, fl, true ) );
+    return _getFileDescriptor( std::allocate_shared< FileDescriptor >( DescriptorAllocator(), file, fl ) );
 }
 
 void Manager::closeFile( int fd ) {
-    getFile( fd ).reset();
+    ArenaScope scope( this );
+    getFile( fd );
+    _recordDescriptor( fd );
+    _openFD.set( fd, nullptr );
 }
 
 int Manager::duplicate( int oldfd, int lowEdge ) {
+    ArenaScope scope( this );
     return _getFileDescriptor( getFile( oldfd ), lowEdge );
 }
 
 int Manager::duplicate2( int oldfd, int newfd ) {
+    ArenaScope scope( this );
     if ( oldfd == newfd )
         return newfd;
     auto f = getFile( oldfd );
-    if ( newfd < 0 || newfd > FILE_DESCRIPTOR_LIMIT )
+    if ( newfd < 0 || size_t( newfd ) >= _openFD.limit() )
         throw Error( EBADF );
-    if ( newfd >= _openFD.size() )
-        _openFD.resize( newfd + 1 );
-    _openFD[ newfd ] = f;
+    _recordDescriptor( newfd );
+    _openFD.set( newfd, f );
     return newfd;
 }
 
 std::shared_ptr< FileDescriptor > &Manager::getFile( int fd ) {
-    if ( fd >= 0 && fd < _openFD.size() && _openFD[ fd ] )
-        return _openFD[ fd ];
+    ArenaScope scope( this );
+    if ( auto f = _openFD.find( fd ) )
+        return _follow( *f );
     throw Error( EBADF );
 }
 
-std::shared_ptr< SocketDescriptor > Manager::getSocket( int sockfd ) {
-    auto f = std::dynamic_pointer_cast< SocketDescriptor >( getFile( sockfd ) );
+Result< std::shared_ptr< FileDescriptor > > Manager::tryGetFile( int fd ) {
+    ArenaScope scope( this );
+    if ( auto f = _openFD.find( fd ) )
+        return _follow( *f );
+    return Error( EBADF );
+}
+
+Result< long long > Manager::tryRead( int fd, void *buf, size_t length ) {
+    ArenaScope scope( this );
+    auto f = tryGetFile( fd );
     if ( !f )
-        throw Error( ENOTSOCK );
+        return Error( f.error() );
+    if ( int error = ( *f )->readError() )
+        return Error( error );
+    _recordPosition( *f );
+    return ( *f )->read( buf, length );
+}
+
+Result< long long > Manager::tryRead( int fd, void *buf, size_t length, off_t offset ) {
+    ArenaScope scope( this );
+    auto f = tryGetFile( fd );
+    if ( !f )
+        return Error( f.error() );
+    if ( int error = ( *f )->readError() )
+        return Error( error );
+
+    auto position = ( *f )->position();
+    auto d = utils::make_defer( [&]{ ( *f )->position( position ); } );
+    ( *f )->offset( offset );
+    return ( *f )->read( buf, length );
+}
+
+Result< long long > Manager::tryWrite( int fd, const void *buf, size_t length ) {
+    ArenaScope scope( this );
+    auto f = tryGetFile( fd );
+    if ( !f )
+        return Error( f.error() );
+    if ( int error = ( *f )->writeError() )
+        return Error( error );
+
+    _recordPosition( *f );
+    return _write( **f, buf, length );
+}
+
+Result< long long > Manager::tryWrite( int fd, const void *buf, size_t length, off_t offset ) {
+    ArenaScope scope( this );
+    auto f = tryGetFile( fd );
+    if ( !f )
+        return Error( f.error() );
+    if ( int error = ( *f )->writeError() )
+        return Error( error );
+
+    auto position = ( *f )->position();
+    auto d = utils::make_defer( [&]{ ( *f )->position( position ); } );
+    ( *f )->offset( offset );
+    return _write( **f, buf, length );
+}
+
+long long Manager::_write( FileDescriptor &f, const void *buf, size_t length ) {
+    f.inode( _writable( f.inode() ) );
+    if ( _journal.recording() ) {
+        size_t offset = f.flags().has( flags::Open::Append ) ? f.size() : f.offset();
+        _recordContent( f.inode(), offset, offset + length );
+    }
+    return f.write( buf, length );
+}
+
+std::shared_ptr< FileDescriptor > &Manager::getWritableFile( int fd ) {
+    ArenaScope scope( this );
+    auto &f = getFile( fd );
+    if ( f->inode() )
+        f->inode( _writable( f->inode() ) );
     return f;
 }
 
+std::shared_ptr< SocketDescriptor > Manager::getSocket( int sockfd ) {
+    ArenaScope scope( this );
+    auto &f = getFile( sockfd );
+    // only sockets are opened through socket descriptors
+    if ( !f->inode() || !f->inode()->mode().isSocket() )
+        throw Error( ENOTSOCK );
+    return std::static_pointer_cast< SocketDescriptor >( f );
+}
+
 std::pair< int, int > Manager::pipe() {
+    ArenaScope scope( this );
     mode_t mode = Mode::RWXUSER | Mode::FIFO;
 
-    Node node = std::allocate_shared< INode >( memory::AllocatorPure(), mode );
-    node->assign( new( memory::nofail ) Pipe() );
+    Node node = _allocateNode( mode );
+    node->emplace< Pipe >();
     return {
-        _getFileDescriptor( std::allocate_shared< PipeDescriptor >( memory::AllocatorPure(), node, flags::Open::Read ) ),
-        _getFileDescriptor( std::allocate_shared< PipeDescriptor >( memory::AllocatorPure(), node, flags::Open::Write ) )
+        _getFileDescriptor( std::allocate_shared< PipeDescriptor >( DescriptorAllocator(), node, flags::Open::Read ) ),
+        _getFileDescriptor( std::allocate_shared< PipeDescriptor >( DescriptorAllocator(), node, flags::Open::Write ) )
     };
 }
 
 void Manager::removeFile( utils::String name ) {
+    ArenaScope scope( this );
     if ( name.empty() )
         throw Error( ENOENT );
 
@@ -255,12 +437,17 @@ void Manager::removeFile( utils::String name ) {
     std::tie( current, name ) = _findDirectoryOfFile( name );
 
     _checkGrants( current, Mode::WUSER );
+    current = _writable( current );
     Directory *dir = current->data()->as< Directory >();
 
+    Node victim = dir->find( name );
+    _recordEntry( current, name );
     dir->remove( name );
+    _unlinked( current, victim );
 }
 
 void Manager::removeDirectory( utils::String name ) {
+    ArenaScope scope( this );
     if ( name.empty() )
         throw Error( ENOENT );
 
@@ -269,12 +456,17 @@ void Manager::removeDirectory( utils::String name ) {
 
 
     _checkGrants( current, Mode::WUSER );
+    current = _writable( current );
     Directory *dir = current->data()->as< Directory >();
 
+    Node victim = dir->find( name );
+    _recordEntry( current, name );
     dir->removeDirectory( name );
+    _unlinked( current, victim );
 }
 
 void Manager::removeAt( int dirfd, utils::String name, flags::At fl ) {
+    ArenaScope scope( this );
     REMEMBER_DIRECTORY( dirfd, name );
 
     switch( fl ) {
@@ -290,10 +482,11 @@ void Manager::removeAt( int dirfd, utils::String name, flags::At fl ) {
 }
 
 void Manager::renameAt( int newdirfd, utils::String newpath, int olddirfd, utils::String oldpath ) {
+    ArenaScope scope( this );
     Node oldNode;
-    Directory *oldNodeDirectory;
+    Node oldDirectory;
     Node newNode;
-    Directory *newNodeDirectory;
+    Node newDirectory;
 
     utils::String oldName;
     utils::String newName;
@@ -301,11 +494,12 @@ void Manager::renameAt( int newdirfd, utils::String newpath, int olddirfd, utils
     {
         REMEMBER_DIRECTORY( olddirfd, oldpath );
 
-        std::tie( oldNode, oldName ) = _findDirectoryOfFile( oldpath );
-        _checkGrants( oldNode, Mode::WUSER );
-        oldNodeDirectory = oldNode->data()->as< Directory >();
+        std::tie( oldDirectory, oldName ) = _findDirectoryOfFile( oldpath );
+        _checkGrants( oldDirectory, Mode::WUSER );
+        oldDirectory = _writable( oldDirectory );
     }
-    oldNode = oldNodeDirectory->find( oldName );
+    Directory *oldNodeDirectory = oldDirectory->data()->as< Directory >();
+    oldNode = _resolve( oldNodeDirectory->find( oldName ) );
     if ( !oldNode )
         throw Error( ENOENT );
 
@@ -315,14 +509,15 @@ void Manager::renameAt( int newdirfd, utils::String newpath, int olddirfd, utils
         newNode = _findDirectoryItem( newpath, false, [&]( Node n ) {
                 if ( n == oldNode )
                     throw Error( EINVAL );
-            } );
+            } ).value();
+        std::tie( newDirectory, newName ) = _findDirectoryOfFile( newpath );
+        _checkGrants( newDirectory, Mode::WUSER );
+        newDirectory = _writable( newDirectory );
     }
+    Directory *newNodeDirectory = newDirectory->data()->as< Directory >();
 
+    _recordEntry( newDirectory, newName );
     if ( !newNode ) {
-        std::tie( newNode, newName ) = _findDirectoryOfFile( newpath );
-        _checkGrants( newNode, Mode::WUSER );
-
-        newNodeDirectory = newNode->data()->as< Directory >();
         newNodeDirectory->create( std::move( newName ), oldNode );
     }
     else {
@@ -336,14 +531,37 @@ void Manager::renameAt( int newdirfd, utils::String newpath, int olddirfd, utils
             throw Error( EISDIR );
 
         newNodeDirectory->replaceEntry( newName, oldNode );
+        _unlinked( newDirectory, newNode );
     }
+    _recordEntry( oldDirectory, oldName );
     oldNodeDirectory->forceRemove( oldName );
+
+    // ".." of a moved directory names the new parent
+    if ( oldNode->mode().isDirectory() && oldDirectory != newDirectory ) {
+        _changeLinks( oldDirectory, -1 );
+        _changeLinks( newDirectory, 1 );
+    }
+}
+
+void Manager::descriptorLimit( size_t limit ) {
+    ArenaScope scope( this );
+    if ( limit > FILE_DESCRIPTOR_HARD_LIMIT )
+        throw Error( EPERM );
+    if ( _journal.recording() ) {
+        size_t previous = _openFD.limit();
+        _journal.record( [this, previous] {
+            _openFD.limit( previous );
+        } );
+    }
+    _openFD.limit( limit );
 }
 
 off_t Manager::lseek( int fd, off_t offset, Seek whence ) {
+    ArenaScope scope( this );
     auto f = getFile( fd );
     if ( f->inode()->mode().isFifo() )
         throw Error( ESPIPE );
+    _recordPosition( f );
 
     switch( whence ) {
     case Seek::Set:
@@ -365,6 +583,17 @@ off_t Manager::lseek( int fd, off_t offset, Seek whence ) {
             throw Error( EINVAL );
         f->offset( f->size() + offset );
         break;
+    case Seek::Data:
+    case Seek::Hole:
+        if ( offset < 0 )
+            throw Error( ENXIO );
+        if ( RegularFile *file = f->inode()->data()->as< RegularFile >() )
+            f->offset( whence == Seek::Data ? file->seekData( offset ) : file->seekHole( offset ) );
+        else if ( size_t( offset ) >= f->size() )
+            throw Error( ENXIO );
+        else
+            f->offset( whence == Seek::Data ? offset : f->size() );
+        break;
     default:
         throw Error( EINVAL );
     }
@@ -372,6 +601,7 @@ off_t Manager::lseek( int fd, off_t offset, Seek whence ) {
 }
 
 void Manager::truncate( Node inode, off_t length ) {
+    ArenaScope scope( this );
     if ( !inode )
         throw Error( ENOENT );
     if ( length < 0 )
@@ -383,11 +613,14 @@ void Manager::truncate( Node inode, off_t length ) {
 
     _checkGrants( inode, Mode::WUSER );
 
+    inode = _writable( inode );
     RegularFile *f = inode->data()->as< RegularFile >();
+    _recordContent( inode, std::min( f->size(), size_t( length ) ), std::max( f->size(), size_t( length ) ) );
     f->resize( length );
 }
 
 void Manager::changeDirectory( utils::String pathname ) {
+    ArenaScope scope( this );
     Node item = findDirectoryItem( pathname );
     if ( !item )
         throw Error( ENOENT );
@@ -395,21 +628,41 @@ void Manager::changeDirectory( utils::String pathname ) {
         throw Error( ENOTDIR );
     _checkGrants( item, Mode::XUSER );
 
+    _recordCurrentDirectory();
     _currentDirectory = item;
 }
 
 void Manager::changeDirectory( int dirfd ) {
+    ArenaScope scope( this );
+    Node item = _directory( dirfd );
+    _recordCurrentDirectory();
+    _currentDirectory = item;
+}
+
+void Manager::umask( mode_t mask ) {
+    ArenaScope scope( this );
+    if ( _journal.recording() ) {
+        unsigned short previous = _umask;
+        _journal.record( [this, previous] {
+            _umask = previous;
+        } );
+    }
+    _umask = Mode::GRANTS & mask;
+}
+
+// the directory the descriptor is open for, if it may be entered
+Node Manager::_directory( int dirfd ) {
     Node item = getFile( dirfd )->inode();
     if ( !item )
         throw Error( ENOENT );
     if ( !item->mode().isDirectory() )
         throw Error( ENOTDIR );
     _checkGrants( item, Mode::XUSER );
-
-    _currentDirectory = item;
+    return item;
 }
 
 void Manager::chmodAt( int dirfd, utils::String name, mode_t mode, Flags< flags::At > fl ) {
+    ArenaScope scope( this );
     if ( fl.has( flags::At::Invalid ) )
         throw Error( EINVAL );
 
@@ -420,53 +673,70 @@ void Manager::chmodAt( int dirfd, utils::String name, mode_t mode, Flags< flags:
 }
 
 void Manager::chmod( int fd, mode_t mode ) {
+    ArenaScope scope( this );
     _chmod( getFile( fd )->inode(), mode );
 }
 
-DirectoryDescriptor *Manager::openDirectory( int fd ) {
+void *Manager::openDirectory( int fd ) {
+    ArenaScope scope( this );
     Node inode = getFile( fd )->inode();
     if ( !inode->mode().isDirectory() )
         throw Error( ENOTDIR );
 
     _checkGrants( inode, Mode::RUSER | Mode::XUSER );
-    _openDD.emplace_back( inode, fd );
-    return &_openDD.back();
+    auto descriptor = std::allocate_shared< DirectoryDescriptor >( DescriptorAllocator(), inode, fd );
+    descriptor->seek( descriptor->mark( getFile( fd )->position() ) );
+    return _openDD.open( std::move( descriptor ) );
 }
 DirectoryDescriptor *Manager::getDirectory( void *descriptor ) {
-    for ( auto i = _openDD.begin(); i != _openDD.end(); ++i ) {
-        if ( &*i == descriptor ) {
-            return &*i;
-        }
-    }
+    ArenaScope scope( this );
+    if ( DirectoryDescriptor *dd = _openDD.find( descriptor ) )
+        return dd;
     throw Error( EBADF );
 }
 void Manager::closeDirectory( void *descriptor ) {
-    for ( auto i = _openDD.begin(); i != _openDD.end(); ++i ) {
-        if ( &*i == descriptor ) {
-            closeFile( i->fd() );
-            _openDD.erase( i );
-            return;
-        }
-    }
-    throw Error( EBADF );
+    ArenaScope scope( this );
+    int fd = getDirectory( descriptor )->fd();
+    _openDD.close( descriptor );
+    closeFile( fd );
+}
+
+long Manager::tellDirectory( void *descriptor ) {
+    ArenaScope scope( this );
+    DirectoryDescriptor *dd = getDirectory( descriptor );
+    // the entry may have been removed since, its name is interned anew then
+    if ( const char *name = dd->last() )
+        dd->cookie( dd->mark( { dd->offset(), _names->intern( name, std::strlen( name ) ) } ) );
+    return dd->cookie();
+}
+
+void Manager::seekDirectory( void *descriptor, long cookie ) {
+    ArenaScope scope( this );
+    DirectoryDescriptor *dd = getDirectory( descriptor );
+    auto position = dd->marked( cookie );
+    auto &f = getFile( dd->fd() );
+    _recordPosition( f );
+    f->position( position );
+    dd->seek( cookie );
 }
 
 int Manager::socket( SocketType type, Flags< flags::Open > fl ) {
-    Socket *s = nullptr;
+    ArenaScope scope( this );
+    Node node = _allocateNode( Mode::GRANTS | Mode::SOCKET );
     switch ( type ) {
     case SocketType::Stream:
-        s = new( memory::nofail ) SocketStream;
+        node->emplace< SocketStream >();
         break;
     case SocketType::Datagram:
-        s = new( memory::nofail ) SocketDatagram;
+        node->emplace< SocketDatagram >();
         break;
     default:
         throw Error( EPROTONOSUPPORT );
     }
     std::shared_ptr< SocketDescriptor > sd =
         std::allocate_shared< SocketDescriptor >(
-            memory::AllocatorPure(),
-            std::allocate_shared< INode >( memory::AllocatorPure(), Mode::GRANTS | Mode::SOCKET, s ),
+            DescriptorAllocator(),
+            std::move( node ),
             fl
         );
 
@@ -474,33 +744,28 @@ int Manager::socket( SocketType type, Flags< flags::Open > fl ) {
 }
 
 std::pair< int, int > Manager::socketpair( SocketType type, Flags< flags::Open > fl ) {
+    ArenaScope scope( this );
     if ( type != SocketType::Stream )
         throw Error( EOPNOTSUPP );
 
-    SocketStream *cl = new( memory::nofail ) SocketStream;
-
-    Node client = std::allocate_shared< INode >(
-        memory::AllocatorPure(),
-        Mode::GRANTS | Mode::SOCKET,
-        cl );
-    Node server = std::allocate_shared< INode >(
-        memory::AllocatorPure(),
-        Mode::GRANTS | Mode::SOCKET,
-        new( memory::nofail ) SocketStream );
+    Node client = _allocateNode( Mode::GRANTS | Mode::SOCKET );
+    Node server = _allocateNode( Mode::GRANTS | Mode::SOCKET );
+    SocketStream *cl = client->emplace< SocketStream >();
+    server->emplace< SocketStream >();
 
     cl->connected( client, server );
 
     return {
         _getFileDescriptor(
             std::allocate_shared< SocketDescriptor >(
-                memory::AllocatorPure(),
+                DescriptorAllocator(),
                 server,
                 fl
             )
         ),
         _getFileDescriptor(
             std::allocate_shared< SocketDescriptor >(
-                memory::AllocatorPure(),
+                DescriptorAllocator(),
                 client,
                 fl
             )
@@ -509,12 +774,14 @@ std::pair< int, int > Manager::socketpair( SocketType type, Flags< flags::Open >
 }
 
 void Manager::bind( int sockfd, Socket::Address address ) {
+    ArenaScope scope( this );
     auto sd = getSocket( sockfd );
 
     Node current;
-    utils::String name = address.value();
+    utils::String name = address.value().str();
     std::tie( current, name ) = _findDirectoryOfFile( name );
 
+    current = _writable( current );
     Directory *dir = current->data()->as< Directory >();
     if ( dir->find( name ) )
         throw Error( EADDRINUSE );
@@ -522,11 +789,14 @@ void Manager::bind( int sockfd, Socket::Address address ) {
     if ( sd->address() )
         throw Error( EINVAL );
 
+    _recordEntry( current, name );
     dir->create( std::move( name ), sd->inode() );
-    sd->address( std::move( address ) );
+    // bound addresses compare by identity
+    sd->address( Socket::Address( _names->intern( address.value() ), address.anonymous() ) );
 }
 
 void Manager::connect( int sockfd, const Socket::Address &address ) {
+    ArenaScope scope( this );
     auto sd = getSocket( sockfd );
 
     Node model = resolveAddress( address );
@@ -535,12 +805,13 @@ void Manager::connect( int sockfd, const Socket::Address &address ) {
 }
 
 int Manager::accept( int sockfd, Socket::Address &address ) {
+    ArenaScope scope( this );
     Node partner = getSocket( sockfd )->accept();
     address = partner->data()->as< Socket >()->address();
 
     return _getFileDescriptor(
         std::allocate_shared< SocketDescriptor >(
-            memory::AllocatorPure(),
+            DescriptorAllocator(),
             std::move( partner ),
             flags::Open::NoFlags
         )
@@ -548,7 +819,8 @@ int Manager::accept( int sockfd, Socket::Address &address ) {
 }
 
 Node Manager::resolveAddress( const Socket::Address &address ) {
-    Node item = findDirectoryItem( address.value() );
+    ArenaScope scope( this );
+    Node item = findDirectoryItem( path::View( address.value().data(), address.value().size() ) );
 
     if ( !item )
         throw Error( ENOENT );
@@ -558,85 +830,106 @@ Node Manager::resolveAddress( const Socket::Address &address ) {
     return item;
 }
 
-Node Manager::findDirectoryItem( utils::String name, bool followSymLinks ) {
-    return _findDirectoryItem( std::move( name ), followSymLinks, []( Node ){} );
+Node Manager::findDirectoryItem( path::View name, bool followSymLinks ) {
+    ArenaScope scope( this );
+    return tryFindDirectoryItem( name, followSymLinks ).value();
+}
+
+Result< Node > Manager::tryFindDirectoryItem( path::View name, bool followSymLinks ) {
+    ArenaScope scope( this );
+    return _findDirectoryItem( name, followSymLinks, []( Node ){} );
 }
 template< typename I >
-Node Manager::_findDirectoryItem( utils::String name, bool followSymLinks, I itemChecker ) {
-    if ( name.size() > PATH_LIMIT )
-        throw Error( ENAMETOOLONG );
-    name = path::normalize( name );
-    Node current = _root;
-    if ( path::isRelative( name ) )
-        current = currentDirectory();
+Result< Node > Manager::_findDirectoryItem( path::View name, bool followSymLinks, I itemChecker ) {
+    if ( name.size > PATH_LIMIT )
+        return Error( ENAMETOOLONG );
+
+    path::Components components;
+    components.split( name.data, name.size, true );
+    // holds the rest of the path only after a symbolic link was expanded
+    utils::String expansion;
+
+    Node current = path::isAbsolute( name ) ?
+        _resolve( _root ) :
+        currentDirectory();
 
     Node item = current;
-    utils::Queue< utils::String > q( path::splitPath< utils::Deque< utils::String > >( name ) );
-    utils::Set< Link * > loopDetector;
-    while ( !q.empty() ) {
+    int links = 0;
+    for ( size_t i = 0; i < components.size(); ) {
         if ( !current->mode().isDirectory() )
-            throw Error( ENOTDIR );
+            return Error( ENOTDIR );
 
-        _checkGrants( current, Mode::XUSER );
+        if ( !_hasGrants( current, Mode::XUSER ) )
+            return Error( EACCES );
 
         Directory *dir = current->data()->as< Directory >();
 
-        {
-            auto d = utils::make_defer( [&]{ q.pop(); } );
-            const auto &subFolder = q.front();
-            if ( subFolder.empty() )
-                continue;
-            if ( subFolder.size() > FILE_NAME_LIMIT )
-                throw Error( ENAMETOOLONG );
-            item = dir->find( subFolder );
-        }
+        const auto &subFolder = components[ i++ ];
+        bool last = i == components.size();
+        if ( subFolder.empty() )
+            continue;
+        if ( subFolder.size > FILE_NAME_LIMIT )
+            return Error( ENAMETOOLONG );
+        item = _resolve( dir->find( subFolder.data, subFolder.size ) );
 
         if ( !item ) {
-            if ( q.empty() )
-                return nullptr;
-            throw Error( ENOENT );
+            if ( last )
+                return Node();
+            return Error( ENOENT );
         }
 
         itemChecker( item );
 
         if ( item->mode().isDirectory() )
             current = item;
-        else if ( item->mode().isLink() && ( followSymLinks || !q.empty() ) ) {
+        else if ( item->mode().isLink() && ( followSymLinks || !last ) ) {
             Link *sl = item->data()->as< Link >();
 
-            if ( !loopDetector.insert( sl ).second )
-                throw Error( ELOOP );
+            if ( ++links > SYMLINK_LIMIT )
+                return Error( ELOOP );
 
-            utils::Queue< utils::String > _q( path::splitPath< utils::Deque< utils::String > >( sl->target() ) );
-            while ( !q.empty() ) {
-                _q.emplace( std::move( q.front() ) );
-                q.pop();
+            // the target replaces the link, the rest of the path follows it
+            utils::String expanded( sl->target() );
+            for ( ; i < components.size(); ++i ) {
+                expanded += path::pathSeparators[ 0 ];
+                expanded.append( components[ i ].data, components[ i ].size );
             }
-            q.swap( _q );
+            if ( expanded.size() > PATH_LIMIT )
+                return Error( ENAMETOOLONG );
+            expansion.swap( expanded );
+            components.split( expansion.data(), expansion.size() );
+            i = 0;
+
             if ( path::isAbsolute( sl->target() ) ) {
-                current = _root;
-                item = _root;
+                current = _resolve( _root );
+                item = current;
             }
             continue;
         }
         else {
-            if ( q.empty() )
+            if ( last )
                 break;
-            throw Error( ENOTDIR );
+            return Error( ENOTDIR );
         }
     }
     return item;
 }
 
-std::pair< Node, utils::String > Manager::_findDirectoryOfFile( utils::String name ) {
-    name = path::normalize( name );
-
-    if ( name.size() > PATH_LIMIT )
+std::pair< Node, utils::String > Manager::_findDirectoryOfFile( path::View name ) {
+    if ( name.size > PATH_LIMIT )
         throw Error( ENAMETOOLONG );
 
-    utils::String pathname;
-    std::tie( pathname, name ) = path::splitFileName( name );
-    Node item = findDirectoryItem( pathname );
+    // the last component names the file, the ones in front of it the directory
+    path::Components components;
+    components.split( name.data, name.size, true );
+    size_t last = components.size();
+    while ( last && components[ last - 1 ].empty() )
+        --last;
+    if ( !last )
+        throw Error( EINVAL );
+    const auto &file = components[ last - 1 ];
+
+    Node item = findDirectoryItem( path::View( name.data, file.data - name.data ) );
 
     if ( !item )
         throw Error( ENOENT );
@@ -644,30 +937,20 @@ std::pair< Node, utils::String > Manager::_findDirectoryOfFile( utils::String na
     if ( !item->mode().isDirectory() )
         throw Error( ENOTDIR );
     _checkGrants( item, Mode::XUSER );
-    return { item, name };
+    return { item, utils::String( file.data, file.size ) };
 }
 
 int Manager::_getFileDescriptor( std::shared_ptr< FileDescriptor > f, int lowEdge ) {
-    int i = 0;
-
-    if ( lowEdge < 0 || lowEdge >= FILE_DESCRIPTOR_LIMIT )
+    if ( lowEdge < 0 || size_t( lowEdge ) >= _openFD.limit() )
         throw Error( EINVAL );
 
-    if ( lowEdge >= _openFD.size() )
-        _openFD.resize( lowEdge + 1 );
-
-    for ( auto &fd : utils::withOffset( _openFD, lowEdge ) ) {
-        if ( !fd ) {
-            fd = f;
-            return i;
-        }
-        ++i;
-    }
-    if ( _openFD.size() >= FILE_DESCRIPTOR_LIMIT )
-        throw Error( ENFILE );
+    int fd = _openFD.lowest( lowEdge );
+    if ( fd < 0 )
+        throw Error( EMFILE );
 
-   _openFD.push_back( f );
-    return i;
+    _recordDescriptor( fd );
+    _openFD.set( fd, std::move( f ) );
+    return fd;
 }
 
 void Manager::_insertSnapshotItem( const SnapshotFS &item ) {
@@ -689,45 +972,305 @@ void Manager::_insertSnapshotItem( const SnapshotFS &item ) {
     }
 }
 
+bool Manager::_hasGrants( const Node &inode, mode_t grant ) const {
+    return ( inode->mode() & grant ) == grant;
+}
+
 void Manager::_checkGrants( Node inode, mode_t grant ) const {
-    if ( ( inode->mode() & grant ) != grant )
+    if ( !_hasGrants( inode, grant ) )
         throw Error( EACCES );
 }
 
+Node Manager::_allocateNode( mode_t mode ) {
+    Node node = refcount::make< INode >( mode );
+    node->generation( _generation );
+    return node;
+}
+
+Node Manager::_resolve( Node node ) const {
+    if ( !node || node->generation() == _generation )
+        return node;
+    const Node *copy = _detached.find( node->ino() );
+    return copy ? *copy : node;
+}
+
+Node Manager::_writable( Node node ) {
+    Node copy = _own( node );
+    // no directory names it, only descriptors can reach it
+    if ( copy && copy != node && !copy->links() )
+        _forget( copy );
+    return copy;
+}
+
+// the node itself if no clone shares it, its copy otherwise
+Node Manager::_own( Node node ) {
+    node = _resolve( node );
+    if ( !node || node->generation() == _generation || !node->data() )
+        return node;
+
+    Node copy = node->data()->clone( *node );
+    if ( !copy )
+        return node;
+
+    copy->generation( _generation );
+    _detached.set( node->ino(), copy );
+    return copy;
+}
+
+// descriptors are pointed to the copies of their nodes when used
+std::shared_ptr< FileDescriptor > &Manager::_follow( std::shared_ptr< FileDescriptor > &f ) {
+    Node inode = f->inode();
+    if ( inode && inode->generation() != _generation ) {
+        Node copy = _resolve( inode );
+        // descriptors of pipes and sockets are shared with the clones
+        if ( copy != inode )
+            f->inode( std::move( copy ) );
+    }
+    return f;
+}
+
+// drops the index entry of a copy which is no longer named in the tree
+void Manager::_forget( Node copy ) {
+    unsigned ino = copy->ino();
+    const Node *entry = _detached.find( ino );
+    if ( !entry || *entry != copy )
+        return;
+
+    // whatever still refers to the original has to hold the copy itself
+    _openFD.forEach( [&]( int, std::shared_ptr< FileDescriptor > &fd ) {
+        if ( fd->inode() && fd->inode()->ino() == ino )
+            fd->inode( copy );
+    } );
+    Node current = _currentDirectory.lock();
+    if ( current && current->ino() == ino )
+        _currentDirectory = copy;
+
+    // the journal may put the original back into a directory
+    _journal.record( [this, ino, copy] {
+        _detached.set( ino, copy );
+    } );
+    _detached.erase( ino );
+}
+
+/*
+ * Undo actions change the nodes this manager owns at the time of the
+ * rollback; a clone made since the change may share the recorded ones.
+ */
+void Manager::_recordEntry( Node directory, const utils::String &name ) {
+    if ( !_journal.recording() )
+        return;
+
+    Node previous = directory->data()->as< Directory >()->find( name );
+    _journal.record( [this, directory, name, previous] {
+        Directory *dir = _own( directory )->data()->as< Directory >();
+        if ( !previous )
+            dir->forceRemove( name );
+        else if ( dir->find( name ) )
+            dir->replaceEntry( name, previous );
+        else
+            dir->create( name, previous );
+    } );
+}
+
+void Manager::_changeLinks( Node inode, int delta ) {
+    if ( _journal.recording() ) {
+        nlink_t links = inode->links();
+        _journal.record( [this, inode, links] {
+            _own( inode )->links( links );
+        } );
+    }
+    inode->links( inode->links() + delta );
+}
+
+// the entry naming the inode has been removed from the directory
+void Manager::_unlinked( Node directory, Node inode ) {
+    inode = _writable( inode );
+    if ( inode->mode().isDirectory() ) {
+        // the entry and its own "."; ".." no longer names the directory
+        _changeLinks( inode, -2 );
+        _changeLinks( directory, -1 );
+    }
+    else
+        _changeLinks( inode, -1 );
+    if ( !inode->links() )
+        _forget( inode );
+}
+
+void Manager::_recordContent( Node inode, size_t from, size_t to ) {
+    if ( !_journal.recording() )
+        return;
+
+    RegularFile *file = inode->data()->as< RegularFile >();
+    if ( !file )
+        return;
+    auto saved = file->save( from, to - from );
+    _journal.record( [this, inode, saved] {
+        _own( inode )->data()->as< RegularFile >()->restore( saved );
+    } );
+}
+
+void Manager::_recordDescriptor( int fd ) {
+    if ( !_journal.recording() )
+        return;
+
+    std::shared_ptr< FileDescriptor > previous;
+    if ( auto f = _openFD.find( fd ) )
+        previous = *f;
+    _journal.record( [this, fd, previous] {
+        _openFD.set( fd, previous );
+    } );
+}
+
+// descriptors of pipes and sockets are shared with the clones, their position does not matter
+void Manager::_recordPosition( const std::shared_ptr< FileDescriptor > &f ) {
+    if ( !_journal.recording() || !f->inode() || f->inode()->mode().isFifo() || f->inode()->mode().isSocket() )
+        return;
+
+    auto position = f->position();
+    _journal.record( [f, position] {
+        f->position( position );
+    } );
+}
+
+void Manager::_recordCurrentDirectory() {
+    if ( !_journal.recording() )
+        return;
+
+    WeakNode previous = _currentDirectory;
+    _journal.record( [this, previous] {
+        _currentDirectory = previous;
+    } );
+}
+
 void Manager::_chmod( Node inode, mode_t mode ) {
+    inode = _writable( inode );
+    if ( _journal.recording() ) {
+        Mode previous = inode->mode();
+        _journal.record( [this, inode, previous] {
+            _own( inode )->mode() = previous;
+        } );
+    }
     inode->mode() =
         ( inode->mode() & ~Mode::CHMOD ) |
         ( mode & Mode::CHMOD );
 }
 
-void * Manager::mmap(int fd, off_t length, off_t offset, Flags<flags::Mapping> flags) {
+void *Manager::mmap( int fd, off_t length, off_t offset, Flags< flags::Mapping > flags,
+                     Flags< flags::Protection > protection )
+{
+    ArenaScope scope( this );
     if ( length <= 0 )
-        throw Error ( EINVAL );
-    auto file = vfs.instance().getFile( fd )->inode()->data()->as< File >();
-    if ( !file ) {
-        throw Error( EBADF );
-    }
-    std::unique_ptr< Memory > ptr(new (memory::nofail) Memory(flags, length, offset, file));
-    if (!ptr) {
-        throw Error ( ENOMEM );
+        throw Error( EINVAL );
+    Node inode;
+    // anonymous mappings ignore the descriptor
+    if ( !flags.has( flags::Mapping::MapAnon ) ) {
+        inode = flags.has( flags::Mapping::MapShared ) ?
+            getWritableFile( fd )->inode() :
+            getFile( fd )->inode();
+        if ( !inode->data()->as< File >() )
+            throw Error( EBADF );
     }
-    void* memory = ptr->getPtr();
-    if ( !memory ){
+    auto memory = std::allocate_shared< Memory >(
+        memory::Allocator< Memory, memory::Category::Content >(), flags, length, offset, inode );
+    void *address = memory->getPtr();
+    if ( !address )
         return nullptr;
+
+    uintptr_t from = reinterpret_cast< uintptr_t >( address );
+    uintptr_t to = from + length;
+    _splitMapping( from );
+    _splitMapping( to );
+    // the new mapping covers the gaps and joins the regions already there
+    auto i = _mappings.lower_bound( from );
+    for ( uintptr_t at = from; at < to; ) {
+        if ( i == _mappings.end() || i->first > at ) {
+            uintptr_t end = i == _mappings.end() ? to : std::min( to, i->first );
+            i = _mappings.emplace_hint( i, at, MappedRegion{ end, { memory }, protection } );
+        }
+        else {
+            i->second.memory.push_back( memory );
+            i->second.protection = protection;
+        }
+        at = i->second.end;
+        ++i;
     }
-    _mappedMemory.push_back( std::move( ptr ));
-    return memory;
+    return address;
 }
 
+void Manager::munmap( void *address, size_t length ) {
+    ArenaScope scope( this );
+    if ( !length )
+        throw Error( EINVAL );
+    uintptr_t from = reinterpret_cast< uintptr_t >( address );
+    uintptr_t to = from + length;
+    _splitMapping( from );
+    _splitMapping( to );
+    // one of the mappings aliasing each region goes, preferably the one
+    // starting at the address; the last one takes the region with it,
+    // addresses which are not mapped are skipped
+    for ( auto i = _mappings.lower_bound( from ); i != _mappings.end() && i->first < to; ) {
+        auto &memory = i->second.memory;
+        auto victim = std::find_if( memory.begin(), memory.end(), [address]( const std::shared_ptr< Memory > &m ) {
+            return m->getPtr() == address;
+        } );
+        memory.erase( victim == memory.end() ? memory.end() - 1 : victim );
+        if ( memory.empty() )
+            i = _mappings.erase( i );
+        else
+            ++i;
+    }
+}
 
-void Manager::munmap(void *directory) {
-    for ( auto i =_mappedMemory.begin(); i != _mappedMemory.end(); ++i ) {
-        if ( i->get()->getPtr() == directory ) {
-            _mappedMemory.erase( i );
-            return;
-        }
+void Manager::mprotect( void *address, size_t length, Flags< flags::Protection > protection ) {
+    ArenaScope scope( this );
+    uintptr_t from = reinterpret_cast< uintptr_t >( address );
+    uintptr_t to = from + length;
+    if ( !_mapped( from, to ) )
+        throw Error( ENOMEM );
+    _splitMapping( from );
+    _splitMapping( to );
+    for ( auto i = _mappings.find( from ); i != _mappings.end() && i->first < to; ++i )
+        i->second.protection = protection;
+}
+
+void Manager::msync( void *address, size_t length ) {
+    ArenaScope scope( this );
+    uintptr_t from = reinterpret_cast< uintptr_t >( address );
+    uintptr_t to = from + length;
+    if ( !_mapped( from, to ) )
+        throw Error( ENOMEM );
+    // shared mappings use buffers of the file itself, only overlapping ones need to exchange changes
+    auto i = _mappings.upper_bound( from );
+    for ( --i; i != _mappings.end() && i->first < to; ++i ) {
+        for ( const auto &m : i->second.memory )
+            m->sync();
+    }
+}
+
+// the region containing the address is split there
+void Manager::_splitMapping( uintptr_t address ) {
+    auto i = _mappings.upper_bound( address );
+    if ( i == _mappings.begin() )
+        return;
+    --i;
+    if ( i->first == address || i->second.end <= address )
+        return;
+    MappedRegion tail = i->second;
+    i->second.end = address;
+    _mappings.emplace_hint( std::next( i ), address, std::move( tail ) );
+}
+
+// whether every address of the range is mapped
+bool Manager::_mapped( uintptr_t from, uintptr_t to ) const {
+    auto i = _mappings.upper_bound( from );
+    if ( i == _mappings.begin() )
+        return false;
+    for ( --i; i != _mappings.end() && i->first <= from && from < i->second.end; ++i ) {
+        from = i->second.end;
+        if ( from >= to )
+            return true;
     }
-    throw Error ( EBADF );
+    return false;
 }
 
 } // namespace fs
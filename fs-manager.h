@@ -14,6 +14,8 @@
 #include "fs-snapshot.h"
 #include "fs-descriptor.h"
 #include "fs-path.h"
+#include "fs-journal.h"
+#include "fs-persistent.h"
 
 #ifndef _FS_MANAGER_H_
 #define _FS_MANAGER_H_
@@ -26,18 +28,21 @@ struct Manager {
     Manager() :
         Manager( true )
     {
-        _standardIO[ 0 ]->assign( new( memory::nofail ) StandardInput() );
+        ArenaScope scope( this );
+        _standardIO[ 0 ]->emplace< StandardInput >();
     }
 
     Manager( const char *in, size_t length ) :
         Manager( true )
     {
-        _standardIO[ 0 ]->assign( new( memory::nofail ) StandardInput( in, length ) );
+        ArenaScope scope( this );
+        _standardIO[ 0 ]->emplace< StandardInput >( in, length );
     }
 
     explicit Manager( const utils::Vector< SnapshotFS > &items ) :
         Manager()
     {
+        ArenaScope scope( this );
         for ( const auto &item : items )
             _insertSnapshotItem( item );
     }
@@ -45,25 +50,76 @@ struct Manager {
     Manager( const char *in, size_t length, const utils::Vector< SnapshotFS > &items ) :
         Manager( in, length )
     {
+        ArenaScope scope( this );
         for ( const auto &item : items )
             _insertSnapshotItem( item );
     }
 
-    Node findDirectoryItem( utils::String name, bool followSymLinks = true );
+    /*
+     * Returns a copy of the file system sharing all nodes with this one.
+     * Nodes are copied lazily, only when one of the two managers modifies
+     * them; open descriptors of regular files and directories are copied,
+     * pipes and sockets stay shared. Directory streams and memory mappings
+     * are not inherited, the clone starts with an empty journal.
+     */
+    std::unique_ptr< Manager > clone();
+
+    /*
+     * Undo journal. The first checkpoint starts recording changes of the
+     * directory tree, file contents, modes and link counts, the descriptor
+     * table with the positions of the descriptors and its limit, the
+     * current directory and the umask; rollback() reverts the changes made
+     * since the mark was taken. Directory streams and memory mappings are
+     * not recorded. Data read from pipes and sockets is not put back.
+     */
+    Journal::Mark checkpoint() {
+        ArenaScope scope( this );
+        return _journal.checkpoint();
+    }
+    void rollback( Journal::Mark mark ) {
+        ArenaScope scope( this );
+        _journal.rollback( mark );
+    }
+    void commit() {
+        ArenaScope scope( this );
+        _journal.commit();
+    }
+
+    // memory used by this manager and its clones, all zero unless built with FS_MEMORY_STATS
+    const memory::Stats &memoryStats() const {
+        return _arena->stats();
+    }
+
+    /*
+     * The try* variants report expected failures (missing files, missing
+     * permissions, EAGAIN, bad descriptors) through the result instead of
+     * throwing Error; unexpected ones are still thrown.
+     */
+    Node findDirectoryItem( path::View name, bool followSymLinks = true );
+    Result< Node > tryFindDirectoryItem( path::View name, bool followSymLinks = true );
 
     void createHardLinkAt( int newdirfd, utils::String name, int olddirfd, const utils::String &target, Flags< flags::At > fl );
     void createSymLinkAt( int dirfd, utils::String name, utils::String target );
     template< typename... Args >
     Node createNodeAt( int dirfd, utils::String name, mode_t mode, Args &&... args );
 
-    ssize_t readLinkAt( int dirfd, utils::String name, char *buf, size_t count );
+    ssize_t readLinkAt( int dirfd, path::View name, char *buf, size_t count );
 
-    void accessAt( int dirfd, utils::String name, Flags< flags::Access > mode, Flags< flags::At > fl );
-    int openFileAt( int dirfd, utils::String name, Flags< flags::Open > fl, mode_t mode );
+    void accessAt( int dirfd, path::View name, Flags< flags::Access > mode, Flags< flags::At > fl );
+    Result< void > tryAccessAt( int dirfd, path::View name, Flags< flags::Access > mode, Flags< flags::At > fl );
+    int openFileAt( int dirfd, path::View name, Flags< flags::Open > fl, mode_t mode );
+    Result< int > tryOpenFileAt( int dirfd, path::View name, Flags< flags::Open > fl, mode_t mode );
     void closeFile( int fd );
     int duplicate( int oldfd, int lowEdge = 0 );
     int duplicate2( int oldfd, int newfd );
     std::shared_ptr< FileDescriptor > &getFile( int fd );
+    std::shared_ptr< FileDescriptor > &getWritableFile( int fd );
+    Result< std::shared_ptr< FileDescriptor > > tryGetFile( int fd );
+    Result< long long > tryRead( int fd, void *buf, size_t length );
+    Result< long long > tryWrite( int fd, const void *buf, size_t length );
+    // pread() and pwrite(), the position of the descriptor does not change
+    Result< long long > tryRead( int fd, void *buf, size_t length, off_t offset );
+    Result< long long > tryWrite( int fd, const void *buf, size_t length, off_t offset );
     std::shared_ptr< SocketDescriptor > getSocket( int sockfd );
 
     std::pair< int, int > pipe();
@@ -78,8 +134,15 @@ struct Manager {
 
     off_t lseek( int fd, off_t offset, Seek whence );
 
+    // the soft limit of RLIMIT_NOFILE
+    size_t descriptorLimit() const {
+        return _openFD.limit();
+    }
+    void descriptorLimit( size_t limit );
+
     template< typename DirPre, typename DirPost, typename File >
     void traverseDirectoryTree( const utils::String &root, DirPre pre, DirPost post, File file ) {
+        ArenaScope scope( this );
         Node current = findDirectoryItem( root );
         if ( !current || !current->mode().isDirectory() )
             return;
@@ -89,8 +152,8 @@ struct Manager {
                 if ( i.name() == "." || i.name() == ".." )
                     continue;
 
-                utils::String pathname = path::joinPath( root, i.name() );
-                if ( i.inode()->mode().isDirectory() )
+                utils::String pathname = path::joinPath( root, i.name().str() );
+                if ( _resolve( i.inode() )->mode().isDirectory() )
                     traverseDirectoryTree( pathname, pre, post, file );
                 else
                     file( pathname );
@@ -100,15 +163,41 @@ struct Manager {
         }
     }
 
+    /*
+     * Hands the entries of the directory from the offset of the descriptor
+     * on to yield( name, inode, offset ) until it returns false; offset is
+     * the one past the entry. Returns whether any entries are left.
+     */
+    template< typename Yield >
+    bool readDirectory( int fd, Yield yield ) {
+        ArenaScope scope( this );
+        auto &f = getFile( fd );
+        if ( !f->inode() || !f->inode()->mode().isDirectory() )
+            throw Error( ENOTDIR );
+
+        const Directory *dir = f->inode()->data()->as< Directory >();
+        _recordPosition( f );
+        while ( const DirectoryEntry *entry = f->directoryEntry( dir ) ) {
+            if ( !yield( entry->name(), _resolve( entry->inode() ), f->offset() + 1 ) )
+                return true;
+            f->directoryEntryRead( *entry );
+        }
+        return false;
+    }
+
     Node currentDirectory() {
-        return _currentDirectory.lock();
+        ArenaScope scope( this );
+        return _resolve( _currentDirectory.lock() );
     }
 
     void changeDirectory( utils::String pathname );
     void changeDirectory( int dirfd );
 
-    void *mmap(int fd, off_t length, off_t offset, Flags<flags::Mapping> flags);
-    void munmap(void *directory);
+    void *mmap( int fd, off_t length, off_t offset, Flags< flags::Mapping > flags,
+                Flags< flags::Protection > protection = flags::Protection::Read | flags::Protection::Write );
+    void munmap( void *address, size_t length );
+    void mprotect( void *address, size_t length, Flags< flags::Protection > protection );
+    void msync( void *address, size_t length );
 
     void chmodAt( int dirfd, utils::String name, mode_t mode, Flags< flags::At > fl );
     void chmod( int fd, mode_t mode );
@@ -116,13 +205,14 @@ struct Manager {
     mode_t umask() const {
         return _umask;
     }
-    void umask( mode_t mask ) {
-        _umask = Mode::GRANTS & mask;
-    }
+    void umask( mode_t mask );
 
-    DirectoryDescriptor *openDirectory( int fd );
+    void *openDirectory( int fd );
     DirectoryDescriptor *getDirectory( void *descriptor );
     void closeDirectory( void *descriptor );
+    // telldir() and seekdir(), see DirectoryDescriptor for the cookies
+    long tellDirectory( void *descriptor );
+    void seekDirectory( void *descriptor, long cookie );
 
     int socket( SocketType type, Flags< flags::Open > fl );
     std::pair< int, int > socketpair( SocketType type, Flags< flags::Open > fl );
@@ -132,25 +222,93 @@ struct Manager {
     Node resolveAddress( const Socket::Address &address );
 
 private:
+    /*
+     * Small objects of the manager and its clones, released last. Every
+     * public member but the plain accessors makes it the current arena of
+     * the calling thread through an ArenaScope, taken before anything is
+     * allocated.
+     */
+    std::shared_ptr< memory::Arena > _arena;
+
+    struct ArenaScope : memory::Arena::Scope {
+        explicit ArenaScope( const Manager *manager ) :
+            memory::Arena::Scope( manager->_arena.get() )
+        {}
+    };
+
+    unsigned _generation;
     Node _root;
     WeakNode _currentDirectory;
     std::array< Node, 2 > _standardIO;
-    utils::Vector< std::shared_ptr< FileDescriptor > > _openFD;
-    utils::List< DirectoryDescriptor > _openDD;
-    utils::Vector < std::unique_ptr< Memory > > _mappedMemory;
+    DescriptorTable _openFD;
+    DirectoryTable _openDD;
+    /*
+     * Mapped memory by start address. Mappings may alias the same buffer
+     * (a shared mapping within another one of the file), so a region
+     * lists every mapping covering it. Each munmap drops one of them, as if
+     * every mmap had an address of its own; the region is unmapped with the
+     * last one and a mapping releases the file once no region lists it.
+     */
+    struct MappedRegion {
+        uintptr_t end;
+        utils::Vector< std::shared_ptr< Memory > > memory;
+        Flags< flags::Protection > protection;
+    };
+    utils::Map< uintptr_t, MappedRegion > _mappings;
 
     unsigned short _umask;
+    /*
+     * Copies of shared nodes made by this manager and still named in its
+     * tree, indexed by ino. A clone shares the map and both extend it on
+     * their own.
+     */
+    persistent::Map< Node > _detached;
+    Journal _journal;
+    // blocks of regular files, shared by all clones
+    std::shared_ptr< storage::BlockStore > _blocks;
+    // name lookups of all directories, shared by all clones
+    std::shared_ptr< DentryCache > _dentries;
+    // names of directory entries and socket addresses, shared by all clones
+    std::shared_ptr< NameTable > _names;
 
     Manager( bool );// private default ctor
+    Manager( Manager &source );
+
+    static unsigned _nextGeneration() {
+        static unsigned generation = 0;
+        return ++generation;
+    }
 
-    std::pair< Node, utils::String > _findDirectoryOfFile( utils::String name );
+    Node _allocateNode( mode_t mode );
+    Node _resolve( Node node ) const;
+    Node _writable( Node node );
+    Node _own( Node node );
+    std::shared_ptr< FileDescriptor > &_follow( std::shared_ptr< FileDescriptor > &f );
+    void _forget( Node copy );
+
+    void _recordEntry( Node directory, const utils::String &name );
+    void _recordContent( Node inode, size_t from, size_t to );
+    void _recordDescriptor( int fd );
+    void _recordPosition( const std::shared_ptr< FileDescriptor > &f );
+    void _recordCurrentDirectory();
+
+    void _changeLinks( Node inode, int delta );
+    void _unlinked( Node directory, Node inode );
+
+    std::pair< Node, utils::String > _findDirectoryOfFile( path::View name );
 
     template< typename I >
-    Node _findDirectoryItem( utils::String name, bool followSymLinks, I itemChecker );
+    Result< Node > _findDirectoryItem( path::View name, bool followSymLinks, I itemChecker );
 
     int _getFileDescriptor( std::shared_ptr< FileDescriptor > f, int lowEdge = 0 );
+    long long _write( FileDescriptor &f, const void *buf, size_t length );
+    Node _directory( int dirfd );
+
+    void _splitMapping( uintptr_t address );
+    bool _mapped( uintptr_t from, uintptr_t to ) const;
     void _insertSnapshotItem( const SnapshotFS &item );
 
+    bool _hasGrants( const Node &inode, mode_t grant ) const;
     void _checkGrants( Node inode, mode_t grant ) const;
 
     void _chmod( Node inode, mode_t mode );
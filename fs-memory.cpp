@@ -6,6 +6,50 @@ namespace divine {
 namespace fs {
 namespace memory {
     nofail_t nofail;
+    FS_THREAD_LOCAL Arena *Arena::_current = nullptr;
+    Stats statistics;
+
+const char *Stats::name( Category c ) {
+    switch ( c ) {
+    case Category::Other:
+        return "other";
+    case Category::Nodes:
+        return "nodes";
+    case Category::Names:
+        return "names";
+    case Category::Directories:
+        return "directories";
+    case Category::Content:
+        return "content";
+    case Category::Pipes:
+        return "pipes";
+    case Category::Descriptors:
+        return "descriptors";
+    }
+    return "unknown";
+}
+
+void Stats::dump( std::FILE *out ) const {
+    auto line = [out]( const char *name, const Usage &u ) {
+        std::fprintf( out, "%-12s %12zu %12zu %12zu %12zu\n", name,
+            std::size_t( u.allocations ), std::size_t( u.live ), std::size_t( u.bytes ), std::size_t( u.peak ) );
+    };
+    std::fprintf( out, "%-12s %12s %12s %12s %12s\n", "category", "allocations", "live", "bytes", "peak" );
+    for ( int i = 0; i < CATEGORIES; ++i )
+        line( name( Category( i ) ), _categories[ i ] );
+    line( "total", _total );
+}
+
+#if defined( FS_MEMORY_STATS ) && !defined( __divine__ )
+namespace {
+struct Report {
+    ~Report() {
+        statistics.dump( stderr );
+    }
+} report;
+} // namespace
+#endif
+
 } // namespace memory
 } // namespace fs
 } // namespace divine
@@ -2,7 +2,10 @@
 
 #include <memory>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdio>
 #include <limits>
+#include <atomic>
 
 #include "divine.h"
 
@@ -14,6 +17,125 @@ namespace fs {
 
 namespace memory {
 
+// what the memory obtained through an Allocator is used for
+enum class Category : unsigned char {
+    Other,
+    Nodes,
+    Names,
+    Directories,
+    Content,
+    Pipes,
+    Descriptors,
+};
+
+// counter of the statistics, atomic in natively multi-threaded builds
+#if defined( FS_ATOMIC_REFCOUNT ) && !defined( __divine__ )
+struct Counter {
+    Counter() :
+        _value( 0 )
+    {}
+
+    std::size_t add( std::size_t n ) {
+        return _value.fetch_add( n, std::memory_order_relaxed ) + n;
+    }
+    void subtract( std::size_t n ) {
+        _value.fetch_sub( n, std::memory_order_relaxed );
+    }
+    // the counter keeps the greater of the two
+    void raise( std::size_t n ) {
+        std::size_t value = _value.load( std::memory_order_relaxed );
+        while ( value < n && !_value.compare_exchange_weak( value, n, std::memory_order_relaxed ) )
+            ;
+    }
+    operator std::size_t() const {
+        return _value.load( std::memory_order_relaxed );
+    }
+
+private:
+    std::atomic< std::size_t > _value;
+};
+#else
+struct Counter {
+    Counter() :
+        _value( 0 )
+    {}
+
+    std::size_t add( std::size_t n ) {
+        return _value += n;
+    }
+    void subtract( std::size_t n ) {
+        _value -= n;
+    }
+    void raise( std::size_t n ) {
+        if ( _value < n )
+            _value = n;
+    }
+    operator std::size_t() const {
+        return _value;
+    }
+
+private:
+    std::size_t _value;
+};
+#endif
+
+struct Usage {
+    Counter allocations; // made so far
+    Counter live;        // not freed yet
+    Counter bytes;       // held by the live ones
+    Counter peak;        // high-water mark of bytes
+};
+
+/*
+ * Usage of memory by category, recorded only in builds with FS_MEMORY_STATS.
+ * Every allocation is counted process-wide, see stats(), and by the arena
+ * current when it was made, see Arena::stats(). Native builds print the
+ * process-wide usage to stderr at exit.
+ */
+struct Stats {
+    static const int CATEGORIES = int( Category::Descriptors ) + 1;
+
+    const Usage &operator[]( Category c ) const {
+        return _categories[ int( c ) ];
+    }
+    const Usage &total() const {
+        return _total;
+    }
+
+    void allocated( Category c, std::size_t bytes ) {
+        _allocated( _categories[ int( c ) ], bytes );
+        _allocated( _total, bytes );
+    }
+    void freed( Category c, std::size_t bytes ) {
+        _freed( _categories[ int( c ) ], bytes );
+        _freed( _total, bytes );
+    }
+
+    static const char *name( Category c );
+    void dump( std::FILE *out ) const;
+
+private:
+    static void _allocated( Usage &u, std::size_t bytes ) {
+        u.allocations.add( 1 );
+        u.live.add( 1 );
+        u.peak.raise( u.bytes.add( bytes ) );
+    }
+    static void _freed( Usage &u, std::size_t bytes ) {
+        u.live.subtract( 1 );
+        u.bytes.subtract( bytes );
+    }
+
+    Usage _categories[ CATEGORIES ];
+    Usage _total;
+};
+
+extern Stats statistics;
+
+// usage of the whole process, all zero unless built with FS_MEMORY_STATS
+inline const Stats &stats() {
+    return statistics;
+}
+
 struct AllocatorBase {
 
     using pointer = void *;
@@ -62,7 +184,189 @@ struct AllocatorBase {
     }
 };
 
-template< typename T >
+// every allocation is a separate heap object
+struct Heap {
+    static void *allocate( std::size_t n ) {
+        return AllocatorBase().allocate( n );
+    }
+    static void deallocate( void *p, std::size_t n ) {
+        AllocatorBase().deallocate( p, n );
+    }
+};
+
+// small allocations are carved from the slabs of the current Arena
+struct Pooled {
+    static void *allocate( std::size_t n );
+    static void deallocate( void *p, std::size_t n );
+};
+
+#ifdef __divine__
+# define FS_THREAD_LOCAL
+#else
+# define FS_THREAD_LOCAL thread_local
+#endif
+
+/*
+ * Slabs of small objects, owned by a manager and shared by its clones.
+ * Objects are carved from the current slab by a pointer bump; freed ones are
+ * kept in a list per size class. The slabs are released all at once with
+ * the last owner, so objects carved from an arena must not outlive it.
+ *
+ * Pooled allocations go to the arena of the innermost Scope of the calling
+ * thread, or to the heap outside of any. An arena is no more synchronised
+ * than the managers owning it: they must not be used by two threads at once.
+ * Builds with FS_MEMORY_STATS charge the usage to the arena as well, so
+ * there no object allocated within a Scope may outlive its arena.
+ */
+struct Arena {
+    // precedes every pooled object, keeps the payload aligned
+    union Header {
+        Arena *arena;
+        std::max_align_t align;
+    };
+
+    static const std::size_t GRANULE = sizeof( Header );
+    static const std::size_t LIMIT = 256;
+    static const std::size_t SLAB_SIZE = 16 * 1024;
+
+    // makes the arena current for the lifetime of the scope
+    struct Scope {
+        explicit Scope( Arena *arena ) :
+            _outer( _current )
+        {
+            _current = arena;
+        }
+        ~Scope() {
+            _current = _outer;
+        }
+
+        Scope( const Scope & ) = delete;
+        Scope &operator=( const Scope & ) = delete;
+
+    private:
+        Arena *_outer;
+    };
+
+    Arena( const Arena & ) = delete;
+    Arena &operator=( const Arena & ) = delete;
+
+    static std::shared_ptr< Arena > create();
+
+    // arena of new pooled allocations, nullptr if they go to the heap
+    static Arena *current() {
+        return _current;
+    }
+
+    // usage of the allocations made while the arena was current
+    const Stats &stats() const {
+        return _stats;
+    }
+    Stats &stats() {
+        return _stats;
+    }
+
+    static std::size_t sizeClass( std::size_t n ) {
+        return ( n + 2 * GRANULE - 1 ) / GRANULE;
+    }
+
+    void *allocate( std::size_t sizeClass ) {
+        if ( Free *f = _free[ sizeClass ] ) {
+            _free[ sizeClass ] = f->next;
+            return f;
+        }
+        std::size_t size = sizeClass * GRANULE;
+        if ( _top + size > _end )
+            _grow();
+        void *p = _top;
+        _top += size;
+        return p;
+    }
+
+    void deallocate( void *p, std::size_t sizeClass ) {
+        Free *f = static_cast< Free * >( p );
+        f->next = _free[ sizeClass ];
+        _free[ sizeClass ] = f;
+    }
+
+private:
+    struct Free {
+        Free *next;
+    };
+    struct Slab {
+        Slab *next;
+    };
+
+    static const std::size_t CLASSES = ( LIMIT + GRANULE - 1 ) / GRANULE + 2;
+
+    Arena() :
+        _slabs( nullptr ),
+        _top( nullptr ),
+        _end( nullptr ),
+        _free()
+    {}
+
+    ~Arena() {
+        while ( _slabs ) {
+            Slab *next = _slabs->next;
+            Heap::deallocate( _slabs, SLAB_SIZE );
+            _slabs = next;
+        }
+    }
+
+    void _grow() {
+        Slab *slab = static_cast< Slab * >( Heap::allocate( SLAB_SIZE ) );
+        slab->next = _slabs;
+        _slabs = slab;
+        _top = reinterpret_cast< char * >( slab ) + GRANULE;
+        _end = reinterpret_cast< char * >( slab ) + SLAB_SIZE;
+    }
+
+    // the last owner is gone
+    static void _release( Arena *arena ) {
+        arena->~Arena();
+        Heap::deallocate( arena, sizeof( Arena ) );
+    }
+
+    static FS_THREAD_LOCAL Arena *_current;
+
+    Slab *_slabs;
+    char *_top;
+    char *_end;
+    Free *_free[ CLASSES ];
+    Stats _stats;
+};
+
+inline void *Pooled::allocate( std::size_t n ) {
+    if ( n > Arena::LIMIT )
+        return Heap::allocate( n );
+    std::size_t sizeClass = Arena::sizeClass( n );
+    Arena *arena = Arena::current();
+    Arena::Header *header = static_cast< Arena::Header * >( arena
+        ? arena->allocate( sizeClass )
+        : Heap::allocate( sizeClass * Arena::GRANULE ) );
+    header->arena = arena;
+    return header + 1;
+}
+
+inline void Pooled::deallocate( void *p, std::size_t n ) {
+    if ( n > Arena::LIMIT )
+        return Heap::deallocate( p, n );
+    std::size_t sizeClass = Arena::sizeClass( n );
+    Arena::Header *header = static_cast< Arena::Header * >( p ) - 1;
+    if ( header->arena )
+        header->arena->deallocate( header, sizeClass );
+    else
+        Heap::deallocate( header, sizeClass * Arena::GRANULE );
+}
+
+#ifdef __divine__
+// DiVinE tracks every object on its own, slabs would only enlarge the states
+using DefaultPolicy = Heap;
+#else
+using DefaultPolicy = Pooled;
+#endif
+
+template< typename T, Category category = Category::Other, typename Policy = DefaultPolicy >
 struct Allocator : AllocatorBase {
     // STL compatibility typedefs
     using value_type = T;
@@ -77,13 +381,13 @@ struct Allocator : AllocatorBase {
     Allocator() {}
     Allocator( const Allocator & ) {};
     template< typename U >
-    Allocator( const Allocator< U > & ) {}
+    Allocator( const Allocator< U, category, Policy > & ) {}
     template< typename U >
     Allocator( const std::allocator< U > & ) {}
 
     template< typename U >
     struct rebind {
-        using other = Allocator< U >;
+        using other = Allocator< U, category, Policy >;
     };
 
     pointer address( reference x ) const {
@@ -93,28 +397,55 @@ struct Allocator : AllocatorBase {
         return &x;
     }
 
-    pointer allocate( size_type n, const_pointer hint = nullptr ) {
-        return static_cast< pointer >( AllocatorBase::allocate( n * sizeof( value_type ), hint ) );
+#ifdef FS_MEMORY_STATS
+    // a header remembers the arena the allocation was charged to
+    pointer allocate( size_type n, const_pointer = nullptr ) {
+        std::size_t bytes = n * sizeof( value_type );
+        Arena::Header *header = static_cast< Arena::Header * >( Policy::allocate( bytes + Arena::GRANULE ) );
+        header->arena = Arena::current();
+        statistics.allocated( category, bytes );
+        if ( header->arena )
+            header->arena->stats().allocated( category, bytes );
+        return reinterpret_cast< pointer >( header + 1 );
+    }
+
+    void deallocate( pointer p, size_type n ) {
+        std::size_t bytes = n * sizeof( value_type );
+        Arena::Header *header = reinterpret_cast< Arena::Header * >( p ) - 1;
+        statistics.freed( category, bytes );
+        if ( header->arena )
+            header->arena->stats().freed( category, bytes );
+        Policy::deallocate( header, bytes + Arena::GRANULE );
+    }
+#else
+    pointer allocate( size_type n, const_pointer = nullptr ) {
+        return static_cast< pointer >( Policy::allocate( n * sizeof( value_type ) ) );
     }
 
     void deallocate( pointer p, size_type n ) {
-        AllocatorBase::deallocate( p, n * sizeof( value_type ) );
+        Policy::deallocate( p, n * sizeof( value_type ) );
     }
+#endif
 
 };
 
 using AllocatorPure = Allocator< char >;
 
-template< typename T1, typename T2 >
-bool operator==( const Allocator< T1 > &, const Allocator< T2 > & ) {
+template< typename T1, typename T2, Category c, typename Policy >
+bool operator==( const Allocator< T1, c, Policy > &, const Allocator< T2, c, Policy > & ) {
     return true;
 }
 
-template< typename T1, typename T2 >
-bool operator!=( const Allocator< T1 > &, const Allocator< T2 > & ) {
+template< typename T1, typename T2, Category c, typename Policy >
+bool operator!=( const Allocator< T1, c, Policy > &, const Allocator< T2, c, Policy > & ) {
     return false;
 }
 
+inline std::shared_ptr< Arena > Arena::create() {
+    Arena *arena = new ( Heap::allocate( sizeof( Arena ) ) ) Arena();
+    return std::shared_ptr< Arena >( arena, &Arena::_release, Allocator< char, Category::Other, Heap >() );
+}
+
 struct nofail_t {};
 extern nofail_t nofail;
 
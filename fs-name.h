@@ -0,0 +1,172 @@
+// -*- C++ -*- (c) 2015 Jiří Weiser
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "fs-utils.h"
+#include "fs-refcount.h"
+
+#ifndef _FS_NAME_H_
+#define _FS_NAME_H_
+
+namespace divine {
+namespace fs {
+
+/*
+ * Immutable name with a precomputed hash, shared by directory entries,
+ * directory listings and socket addresses. Names interned by one NameTable
+ * are equal exactly if they are the same object; names made elsewhere are
+ * compared by hash and then by text.
+ */
+struct Name {
+    Name() = default;
+
+    // a name of its own, not interned
+    Name( const char *data, size_t length ) :
+        _entry( refcount::make< Entry >( data, length, utils::hash( data, length ) ) )
+    {}
+
+    const char *data() const {
+        return _entry ? _entry->text.data() : "";
+    }
+    size_t size() const {
+        return _entry ? _entry->text.size() : 0;
+    }
+    bool empty() const {
+        return !size();
+    }
+    const char *begin() const {
+        return data();
+    }
+    const char *end() const {
+        return data() + size();
+    }
+
+    uint64_t hash() const {
+        return _entry ? _entry->hash : utils::hash( "", 0 );
+    }
+
+    utils::String str() const {
+        return utils::String( data(), size() );
+    }
+
+    int compare( const char *other, size_t length ) const {
+        int r = std::char_traits< char >::compare( data(), other, std::min( size(), length ) );
+        if ( r )
+            return r;
+        return size() < length ? -1 : size() > length;
+    }
+
+    bool operator==( const Name &other ) const {
+        if ( _entry == other._entry )
+            return true;
+        return hash() == other.hash() && !compare( other.data(), other.size() );
+    }
+    bool operator!=( const Name &other ) const {
+        return !operator==( other );
+    }
+    bool operator==( const char *other ) const {
+        return !compare( other, std::strlen( other ) );
+    }
+    bool operator!=( const char *other ) const {
+        return !operator==( other );
+    }
+    bool operator<( const Name &other ) const {
+        return compare( other.data(), other.size() ) < 0;
+    }
+
+    void swap( Name &other ) {
+        _entry.swap( other._entry );
+    }
+
+private:
+    friend struct NameTable;
+
+    struct Entry : refcount::Counted< memory::Category::Names > {
+        using Text = std::basic_string< char, std::char_traits< char >, memory::Allocator< char, memory::Category::Names > >;
+
+        Entry( const char *data, size_t length, uint64_t hash ) :
+            hash( hash ),
+            text( data, length )
+        {}
+
+        uint64_t hash;
+        Text text;
+    };
+
+    explicit Name( refcount::Strong< Entry > entry ) :
+        _entry( std::move( entry ) )
+    {}
+
+    refcount::Strong< Entry > _entry;
+};
+
+inline void swap( Name &lhs, Name &rhs ) {
+    lhs.swap( rhs );
+}
+
+/*
+ * Names interned by a manager, shared by its clones. The table does not own
+ * the names; names nobody uses any more are swept away lazily.
+ */
+struct NameTable {
+    NameTable() :
+        _entries( 0 ),
+        _limit( 64 )
+    {}
+
+    NameTable( const NameTable & ) = delete;
+    NameTable &operator=( const NameTable & ) = delete;
+
+    Name intern( const char *data, size_t length ) {
+        uint64_t hash = utils::hash( data, length );
+        auto &bucket = _names[ hash ];
+        for ( const auto &n : bucket ) {
+            auto entry = n.lock();
+            if ( entry && !entry->text.compare( 0, Name::Entry::Text::npos, data, length ) )
+                return Name( std::move( entry ) );
+        }
+        auto entry = refcount::make< Name::Entry >( data, length, hash );
+        bucket.emplace_back( entry );
+        if ( ++_entries >= _limit )
+            _sweep();
+        return Name( std::move( entry ) );
+    }
+
+    Name intern( const utils::String &name ) {
+        return intern( name.data(), name.size() );
+    }
+
+    Name intern( const Name &name ) {
+        return intern( name.data(), name.size() );
+    }
+
+private:
+    using WeakEntry = refcount::Weak< Name::Entry >;
+
+    void _sweep() {
+        for ( auto n = _names.begin(); n != _names.end(); ) {
+            auto &bucket = n->second;
+            auto last = std::remove_if( bucket.begin(), bucket.end(), []( const WeakEntry &w ) {
+                return w.expired();
+            } );
+            _entries -= bucket.end() - last;
+            bucket.erase( last, bucket.end() );
+            if ( bucket.empty() )
+                n = _names.erase( n );
+            else
+                ++n;
+        }
+        _limit = std::max( _limit, 2 * _entries );
+    }
+
+    utils::UnorderedMap< uint64_t, utils::Vector< WeakEntry > > _names;
+    size_t _entries;
+    size_t _limit;
+};
+
+} // namespace fs
+} // namespace divine
+
+#endif
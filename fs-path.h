@@ -4,7 +4,10 @@
  *  This file contains couple of (sometimes a little bit modified)
  *  functions from bricks/brick-fs.h.
  */
+#include <array>
+
 #include "fs-utils.h"
+#include "fs-constants.h"
 
 #ifndef _FS_PATH_H_
 #define _FS_PATH_H_
@@ -28,6 +31,35 @@ inline bool isPathSeparator( char c ) {
     return false;
 }
 
+/*
+ * Path which is not owned: a C string or the text of a string. Lookups
+ * take it, so that no string is built for them.
+ */
+struct View {
+    View( const char *path ) :
+        data( path ),
+        size( std::char_traits< char >::length( path ) )
+    {}
+    View( const utils::String &path ) :
+        data( path.data() ),
+        size( path.size() )
+    {}
+    View( const char *data, size_t size ) :
+        data( data ),
+        size( size )
+    {}
+
+    bool empty() const {
+        return !size;
+    }
+    utils::String str() const {
+        return utils::String( data, size );
+    }
+
+    const char *data;
+    size_t size;
+};
+
 inline std::pair< utils::String, utils::String > absolutePrefix( utils::String path ) {
 #ifdef _WIN32 /* this must go before general case, because \ is prefix of \\ */
     if ( path.size() >= 3 && path[ 1 ] == ':' && isPathSeparator( path[ 2 ] ) )
@@ -41,12 +73,17 @@ inline std::pair< utils::String, utils::String > absolutePrefix( utils::String p
     return std::make_pair( utils::String(), path );
 }
 
-inline bool isAbsolute( utils::String path ) {
-    return absolutePrefix( std::move( path ) ).first.size() != 0;
+// the same test as absolutePrefix() does
+inline bool isAbsolute( View path ) {
+#ifdef _WIN32
+    if ( path.size >= 3 && path.data[ 1 ] == ':' && isPathSeparator( path.data[ 2 ] ) )
+        return true;
+#endif
+    return path.size >= 1 && isPathSeparator( path.data[ 0 ] );
 }
 
-inline bool isRelative( utils::String path ) {
-    return !isAbsolute( std::move( path ) );
+inline bool isRelative( View path ) {
+    return !isAbsolute( path );
 }
 
 inline std::pair< utils::String, utils::String > splitFileName( utils::String path ) {
@@ -124,6 +161,72 @@ inline utils::String normalize( utils::String path ) {
     return joinPath( abs.first, joinPath( splitPath( abs.second, true ) ) );
 }
 
+/*
+ * Components of a path as views into the path itself. The split does not
+ * allocate, it holds as many components as a path of PATH_LIMIT characters
+ * can have. With normalization, "." and ".." are resolved lexically the
+ * same way as normalize() does.
+ */
+struct Components {
+
+    struct View {
+        const char *data;
+        unsigned short size;
+
+        bool empty() const {
+            return !size;
+        }
+        bool is( const char *s ) const {
+            return size == std::char_traits< char >::length( s ) &&
+                std::equal( data, data + size, s );
+        }
+    };
+
+    Components() :
+        _count( 0 )
+    {}
+
+    Components( const Components & ) = delete;
+    Components &operator=( const Components & ) = delete;
+
+    // the path has to be at most PATH_LIMIT characters long
+    void split( const char *path, size_t length, bool normalize = false ) {
+        _count = 0;
+        const char *end = path + length;
+        if ( path != end && isPathSeparator( *path ) )
+            ++path;
+        while ( true ) {
+            const char *next = std::find_if( path, end, &isPathSeparator );
+            if ( next == end || next != path )
+                _push( { path, static_cast< unsigned short >( next - path ) }, normalize );
+            if ( next == end )
+                return;
+            path = next + 1;
+        }
+    }
+
+    size_t size() const {
+        return _count;
+    }
+    const View &operator[]( size_t index ) const {
+        return _items[ index ];
+    }
+
+private:
+    void _push( View component, bool normalize ) {
+        if ( normalize && component.is( "." ) )
+            return;
+        if ( normalize && component.is( ".." ) && _count && !_items[ _count - 1 ].is( ".." ) ) {
+            --_count;
+            return;
+        }
+        _items[ _count++ ] = component;
+    }
+
+    std::array< View, PATH_LIMIT / 2 + 1 > _items;
+    size_t _count;
+};
+
 } // namespace path
 } // namespace fs
 } // namespace divine
@@ -0,0 +1,149 @@
+// -*- C++ -*- (c) 2015 Jiří Weiser
+
+#include <utility>
+
+#include "fs-refcount.h"
+
+#ifndef _FS_PERSISTENT_H_
+#define _FS_PERSISTENT_H_
+
+namespace divine {
+namespace fs {
+namespace persistent {
+
+/*
+ * Map of unsigned keys sharing its structure with its copies. Copying is
+ * constant; a modification copies only the path to the changed item, so
+ * the copies never see each other's changes. It is a treap whose priorities
+ * are hashes of the keys, so equal maps have equal shapes.
+ */
+template< typename Value >
+struct Map {
+
+    const Value *find( unsigned key ) const {
+        for ( const Item *i = _root.get(); i; i = key < i->key ? i->left.get() : i->right.get() ) {
+            if ( i->key == key )
+                return &i->value;
+        }
+        return nullptr;
+    }
+
+    void set( unsigned key, Value value ) {
+        _root = _set( _root, key, value );
+    }
+
+    void erase( unsigned key ) {
+        _root = _erase( _root, key );
+    }
+
+    bool empty() const {
+        return !_root;
+    }
+
+private:
+    struct Item;
+    using Link = refcount::Strong< Item >;
+
+    struct Item : refcount::Counted<> {
+        Item( unsigned key, const Value &value, Link left, Link right ) :
+            key( key ),
+            value( value ),
+            left( std::move( left ) ),
+            right( std::move( right ) )
+        {}
+
+        unsigned key;
+        Value value;
+        Link left;
+        Link right;
+    };
+
+    static Link _make( unsigned key, const Value &value, Link left, Link right ) {
+        return refcount::make< Item >( key, value, std::move( left ), std::move( right ) );
+    }
+
+    // finalizer of MurmurHash3
+    static unsigned _priority( unsigned key ) {
+        key ^= key >> 16;
+        key *= 0x85ebca6bu;
+        key ^= key >> 13;
+        key *= 0xc2b2ae35u;
+        key ^= key >> 16;
+        return key;
+    }
+
+    // whether the item of the key goes above the item of the other one
+    static bool _above( unsigned key, unsigned other ) {
+        unsigned p = _priority( key ), q = _priority( other );
+        return p > q || ( p == q && key < other );
+    }
+
+    static Link _set( const Link &t, unsigned key, const Value &value ) {
+        if ( !t || ( key != t->key && _above( key, t->key ) ) ) {
+            Link left, right;
+            _split( t, key, left, right );
+            return _make( key, value, std::move( left ), std::move( right ) );
+        }
+        if ( key == t->key )
+            return _make( key, value, t->left, t->right );
+        if ( key < t->key )
+            return _make( t->key, t->value, _set( t->left, key, value ), t->right );
+        return _make( t->key, t->value, t->left, _set( t->right, key, value ) );
+    }
+
+    // items below the key go to the left, items above it to the right
+    static void _split( const Link &t, unsigned key, Link &left, Link &right ) {
+        if ( !t ) {
+            left = right = nullptr;
+            return;
+        }
+        Link middle;
+        if ( t->key < key ) {
+            _split( t->right, key, middle, right );
+            left = _make( t->key, t->value, t->left, std::move( middle ) );
+        }
+        else if ( key < t->key ) {
+            _split( t->left, key, left, middle );
+            right = _make( t->key, t->value, std::move( middle ), t->right );
+        }
+        else {
+            left = t->left;
+            right = t->right;
+        }
+    }
+
+    static Link _erase( const Link &t, unsigned key ) {
+        if ( !t )
+            return t;
+        if ( key == t->key )
+            return _merge( t->left, t->right );
+
+        const Link &below = key < t->key ? t->left : t->right;
+        Link changed = _erase( below, key );
+        // the key is not there, nothing has to be copied
+        if ( changed == below )
+            return t;
+        if ( key < t->key )
+            return _make( t->key, t->value, std::move( changed ), t->right );
+        return _make( t->key, t->value, t->left, std::move( changed ) );
+    }
+
+    // all keys of the left one are below all keys of the right one
+    static Link _merge( const Link &left, const Link &right ) {
+        if ( !left )
+            return right;
+        if ( !right )
+            return left;
+        if ( _above( left->key, right->key ) )
+            return _make( left->key, left->value, left->left, _merge( left->right, right ) );
+        return _make( right->key, right->value, _merge( left, right->left ), right->right );
+    }
+
+    Link _root;
+};
+
+} // namespace persistent
+} // namespace fs
+} // namespace divine
+
+#endif
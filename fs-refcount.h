@@ -0,0 +1,305 @@
+// -*- C++ -*- (c) 2015 Jiří Weiser
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <utility>
+
+#include "fs-memory.h"
+
+#ifndef _FS_REFCOUNT_H_
+#define _FS_REFCOUNT_H_
+
+namespace divine {
+namespace fs {
+namespace refcount {
+
+// counters of single-threaded builds
+struct Plain {
+    using Counter = unsigned;
+
+    static void increment( Counter &c ) {
+        ++c;
+    }
+    static unsigned decrement( Counter &c ) {
+        return --c;
+    }
+    // increments the counter unless it has already dropped to zero
+    static bool acquire( Counter &c ) {
+        if ( !c )
+            return false;
+        ++c;
+        return true;
+    }
+    static unsigned load( const Counter &c ) {
+        return c;
+    }
+};
+
+// counters of natively multi-threaded builds
+struct Atomic {
+    using Counter = std::atomic< unsigned >;
+
+    static void increment( Counter &c ) {
+        c.fetch_add( 1, std::memory_order_relaxed );
+    }
+    static unsigned decrement( Counter &c ) {
+        return c.fetch_sub( 1, std::memory_order_acq_rel ) - 1;
+    }
+    static bool acquire( Counter &c ) {
+        unsigned value = c.load( std::memory_order_relaxed );
+        do {
+            if ( !value )
+                return false;
+        } while ( !c.compare_exchange_weak( value, value + 1, std::memory_order_acq_rel, std::memory_order_relaxed ) );
+        return true;
+    }
+    static unsigned load( const Counter &c ) {
+        return c.load( std::memory_order_acquire );
+    }
+};
+
+#ifdef FS_ATOMIC_REFCOUNT
+using Policy = Atomic;
+#else
+using Policy = Plain;
+#endif
+
+template< typename T >
+struct Strong;
+template< typename T >
+struct Weak;
+
+/*
+ * Base of intrusively counted objects. The object is disposed of with the
+ * last strong handle and destroyed with the last weak one; all strong
+ * handles together hold a single weak reference.
+ */
+template< memory::Category category = memory::Category::Other, typename P = Policy >
+struct Counted {
+    using CountPolicy = P;
+    static const memory::Category CATEGORY = category;
+
+    unsigned useCount() const {
+        return P::load( _strong );
+    }
+
+protected:
+    Counted() :
+        _strong( 0 ),
+        _weak( 1 )
+    {}
+    Counted( const Counted & ) :
+        Counted()
+    {}
+    Counted &operator=( const Counted & ) {
+        return *this;
+    }
+
+    // releases what the object owns while weak handles keep its memory
+    void dispose() {}
+
+private:
+    template< typename >
+    friend struct Strong;
+    template< typename >
+    friend struct Weak;
+
+    typename P::Counter _strong;
+    typename P::Counter _weak;
+};
+
+template< typename T >
+struct Strong {
+    Strong() :
+        _ptr( nullptr )
+    {}
+    Strong( std::nullptr_t ) :
+        _ptr( nullptr )
+    {}
+    Strong( const Strong &other ) :
+        _ptr( other._ptr )
+    {
+        if ( _ptr )
+            T::CountPolicy::increment( _ptr->_strong );
+    }
+    Strong( Strong &&other ) :
+        _ptr( other._ptr )
+    {
+        other._ptr = nullptr;
+    }
+    ~Strong() {
+        _release();
+    }
+
+    Strong &operator=( Strong other ) {
+        swap( other );
+        return *this;
+    }
+
+    void swap( Strong &other ) {
+        std::swap( _ptr, other._ptr );
+    }
+
+    void reset() {
+        _release();
+        _ptr = nullptr;
+    }
+
+    T *get() const {
+        return _ptr;
+    }
+    T *operator->() const {
+        return _ptr;
+    }
+    T &operator*() const {
+        return *_ptr;
+    }
+    explicit operator bool() const {
+        return _ptr != nullptr;
+    }
+
+    unsigned use_count() const {
+        return _ptr ? _ptr->useCount() : 0;
+    }
+
+private:
+    template< typename >
+    friend struct Weak;
+    template< typename U, typename... Args >
+    friend Strong< U > make( Args &&... );
+
+    // takes over a strong reference which has already been counted
+    explicit Strong( T *ptr ) :
+        _ptr( ptr )
+    {}
+
+    static Strong _adopt( T *ptr ) {
+        T::CountPolicy::increment( ptr->_strong );
+        return Strong( ptr );
+    }
+
+    void _release() {
+        if ( !_ptr || T::CountPolicy::decrement( _ptr->_strong ) )
+            return;
+        _ptr->dispose();
+        Weak< T >::_release( _ptr );
+    }
+
+    T *_ptr;
+};
+
+template< typename T >
+struct Weak {
+    Weak() :
+        _ptr( nullptr )
+    {}
+    Weak( const Strong< T > &strong ) :
+        _ptr( strong._ptr )
+    {
+        if ( _ptr )
+            T::CountPolicy::increment( _ptr->_weak );
+    }
+    Weak( const Weak &other ) :
+        _ptr( other._ptr )
+    {
+        if ( _ptr )
+            T::CountPolicy::increment( _ptr->_weak );
+    }
+    Weak( Weak &&other ) :
+        _ptr( other._ptr )
+    {
+        other._ptr = nullptr;
+    }
+    ~Weak() {
+        _release( _ptr );
+    }
+
+    Weak &operator=( Weak other ) {
+        swap( other );
+        return *this;
+    }
+
+    void swap( Weak &other ) {
+        std::swap( _ptr, other._ptr );
+    }
+
+    void reset() {
+        _release( _ptr );
+        _ptr = nullptr;
+    }
+
+    bool expired() const {
+        return !_ptr || !T::CountPolicy::load( _ptr->_strong );
+    }
+
+    Strong< T > lock() const {
+        if ( _ptr && T::CountPolicy::acquire( _ptr->_strong ) )
+            return Strong< T >( _ptr );
+        return nullptr;
+    }
+
+private:
+    template< typename >
+    friend struct Strong;
+
+    static void _release( T *ptr ) {
+        if ( !ptr || T::CountPolicy::decrement( ptr->_weak ) )
+            return;
+        ptr->~T();
+        memory::Allocator< T, T::CATEGORY >().deallocate( ptr, 1 );
+    }
+
+    T *_ptr;
+};
+
+template< typename T, typename... Args >
+Strong< T > make( Args &&... args ) {
+    memory::Allocator< T, T::CATEGORY > allocator;
+    T *ptr = allocator.allocate( 1 );
+    try {
+        new ( ptr ) T( std::forward< Args >( args )... );
+    } catch ( ... ) {
+        allocator.deallocate( ptr, 1 );
+        throw;
+    }
+    return Strong< T >::_adopt( ptr );
+}
+
+template< typename T, typename U >
+bool operator==( const Strong< T > &lhs, const Strong< U > &rhs ) {
+    return lhs.get() == rhs.get();
+}
+template< typename T, typename U >
+bool operator!=( const Strong< T > &lhs, const Strong< U > &rhs ) {
+    return lhs.get() != rhs.get();
+}
+template< typename T >
+bool operator==( const Strong< T > &lhs, std::nullptr_t ) {
+    return !lhs;
+}
+template< typename T >
+bool operator!=( const Strong< T > &lhs, std::nullptr_t ) {
+    return bool( lhs );
+}
+template< typename T, typename U >
+bool operator<( const Strong< T > &lhs, const Strong< U > &rhs ) {
+    return std::less< const void * >()( lhs.get(), rhs.get() );
+}
+
+} // namespace refcount
+} // namespace fs
+} // namespace divine
+
+namespace std {
+
+template< typename T >
+struct hash< divine::fs::refcount::Strong< T > > {
+    size_t operator()( const divine::fs::refcount::Strong< T > &s ) const {
+        return hash< T * >()( s.get() );
+    }
+};
+
+} // namespace std
+
+#endif
@@ -1,6 +1,8 @@
 // -*- C++ -*- (c) 2015 Jiří Weiser
 //             (c) 2014 Vladimír Štill
 //  StrongEnumFlags is ported from bricks/brick-types.h
+#include <memory>
+
 #include "fs-utils.h"
 
 #ifndef _FS_STORAGE_H_
@@ -161,7 +163,7 @@ struct Stream {
         if ( newCapacity < size() )
             return false;
 
-        utils::Vector< char > newData( newCapacity );
+        Buffer newData( newCapacity );
 
         _occupied = pop( &newData.front(), _occupied );
         _head = 0;
@@ -170,7 +172,8 @@ struct Stream {
     }
 
 private:
-    using Iterator = utils::Vector< char >::iterator;
+    using Buffer = std::vector< char, memory::Allocator< char, memory::Category::Pipes > >;
+    using Iterator = Buffer::iterator;
 
     Iterator begin() {
         return _data.begin() + _head;
@@ -179,11 +182,608 @@ private:
         return _data.begin() + ( _head + _occupied ) % capacity();
     }
 
-    utils::Vector< char > _data;
+    Buffer _data;
     size_t _head;
     size_t _occupied;
 };
 
+/*
+ * Content-addressed set of blocks. Blocks with equal content are stored only
+ * once; the store does not own them, blocks nobody uses any more are swept
+ * away lazily.
+ */
+struct BlockStore {
+    using Block = std::vector< char, memory::Allocator< char, memory::Category::Content > >;
+
+    BlockStore() :
+        _entries( 0 ),
+        _limit( 64 )
+    {}
+
+    BlockStore( const BlockStore & ) = delete;
+    BlockStore &operator=( const BlockStore & ) = delete;
+
+    static size_t hash( const Block &block ) {
+        return utils::hash( block.data(), block.size() );
+    }
+
+    // returns the stored block with the same content or remembers this one
+    std::shared_ptr< Block > intern( std::shared_ptr< Block > block, size_t hash ) {
+        auto &bucket = _blocks[ hash ];
+        for ( const auto &b : bucket ) {
+            auto stored = b.lock();
+            if ( stored && *stored == *block )
+                return stored;
+        }
+        bucket.emplace_back( block );
+        if ( ++_entries >= _limit )
+            _sweep();
+        return block;
+    }
+
+    // the block is going to be modified in place
+    void release( const std::shared_ptr< Block > &block, size_t hash ) {
+        auto b = _blocks.find( hash );
+        if ( b == _blocks.end() )
+            return;
+        auto &bucket = b->second;
+        for ( auto i = bucket.begin(); i != bucket.end(); ++i ) {
+            if ( i->lock() == block ) {
+                bucket.erase( i );
+                --_entries;
+                break;
+            }
+        }
+        if ( bucket.empty() )
+            _blocks.erase( b );
+    }
+
+private:
+    void _sweep() {
+        for ( auto b = _blocks.begin(); b != _blocks.end(); ) {
+            auto &bucket = b->second;
+            auto last = std::remove_if( bucket.begin(), bucket.end(), []( const std::weak_ptr< Block > &w ) {
+                return w.expired();
+            } );
+            _entries -= bucket.end() - last;
+            bucket.erase( last, bucket.end() );
+            if ( bucket.empty() )
+                b = _blocks.erase( b );
+            else
+                ++b;
+        }
+        _limit = std::max( _limit, 2 * _entries );
+    }
+
+    utils::UnorderedMap< size_t, utils::Vector< std::weak_ptr< Block > > > _blocks;
+    size_t _entries;
+    size_t _limit;
+};
+
+/*
+ * Random-access byte storage split into chunks of fixed size. Only chunks
+ * touched by an operation are reallocated, so appends cost amortized O(1)
+ * and no single allocation is ever bigger than the chunk size. A chunk may
+ * hold fewer bytes than the chunk size, the rest of it reads as zeros.
+ *
+ * The chunk table is sparse: ranges which were never written to (holes) have
+ * no chunk at all, read as zeros and cost no memory.
+ *
+ * Chunks may be backed by read-only memory (snapshot data); such a chunk is
+ * copied only when it is written to, the other chunks keep pointing to the
+ * read-only memory.
+ *
+ * Chunk blocks are reference counted and copied on write, so a copy of the
+ * storage shares all data with the original until one of them is modified.
+ * With a block store attached, full chunks are deduplicated through it.
+ *
+ * A range may be pinned to obtain a contiguous buffer (used by mmap); the
+ * chunks of the range are then backed by the pinned buffer until unpinned.
+ * Holes get a chunk while pinned and become holes again unless something
+ * else than zeros was stored in them. A range within a pinned one shares
+ * its buffer, any other range gets a buffer of its own. A chunk backed by
+ * several buffers keeps its bytes as of the last sync as a base; changes
+ * made through one buffer reach the others at sync(), pin() and unpin(),
+ * while read(), write() and resize() see and update all of them at once.
+ */
+struct Chunks {
+private:
+    using Block = BlockStore::Block;
+
+    struct Chunk {
+        // the base of a chunk backed by several buffers
+        std::shared_ptr< Block > data;
+        const char *snapshot = nullptr;
+        // one of the buffers backing the chunk, pins of them in total
+        char *pinned = nullptr;
+        unsigned pins = 0;
+        // the chunk was a hole when it got pinned
+        bool hole = false;
+        bool interned = false;
+        size_t hash = 0;
+    };
+
+public:
+    // chunks covering a range together with the size, see save()
+    struct Saved {
+        size_t size;
+        size_t first;
+        size_t count;
+        utils::Vector< std::pair< size_t, Chunk > > chunks;
+    };
+
+    explicit Chunks( size_t chunkSize ) :
+        _chunkSize( chunkSize ),
+        _size( 0 ),
+        _snapshotSize( 0 )
+    {}
+
+    Chunks( size_t chunkSize, const char *snapshot, size_t length ) :
+        _chunkSize( chunkSize ),
+        _size( length ),
+        _snapshotSize( length )
+    {
+        for ( size_t i = 0; i * _chunkSize < length; ++i )
+            _chunks.emplace_hint( _chunks.end(), i, Chunk() )->second.snapshot = snapshot + i * _chunkSize;
+    }
+
+    Chunks( const Chunks &other ) :
+        _chunks( other._chunks ),
+        _store( other._store ),
+        _chunkSize( other._chunkSize ),
+        _size( other._size ),
+        _snapshotSize( other._snapshotSize )
+    {
+        // pinned buffers belong to the original, copy the bytes out of them
+        for ( auto c = _chunks.begin(); c != _chunks.end(); ) {
+            if ( !c->second.pinned ) {
+                ++c;
+                continue;
+            }
+            if ( !other._unpinned( *c, c->second ) )
+                c = _chunks.erase( c );
+            else
+                ++c;
+        }
+    }
+    Chunks( Chunks && ) = default;
+    Chunks &operator=( Chunks ) = delete;
+
+    size_t size() const {
+        return _size;
+    }
+
+    void store( std::shared_ptr< BlockStore > store ) {
+        _store = std::move( store );
+    }
+
+    size_t read( char *data, size_t offset, size_t length ) const {
+        if ( offset >= _size )
+            return 0;
+        if ( offset + length > _size )
+            length = _size - offset;
+
+        auto c = _chunks.lower_bound( offset / _chunkSize );
+        for ( size_t done = 0; done < length; ) {
+            size_t index = ( offset + done ) / _chunkSize;
+            size_t from = ( offset + done ) % _chunkSize;
+            size_t part = std::min( length - done, _chunkSize - from );
+
+            size_t copied = 0;
+            if ( c != _chunks.end() && c->first == index ) {
+                if ( c->second.pinned ) {
+                    copied = part;
+                    _current( *c, data + done, from, part );
+                }
+                else {
+                    size_t available;
+                    const char *source = _bytes( *c, available );
+                    copied = from < available ? std::min( part, available - from ) : 0;
+                    std::copy( source + from, source + from + copied, data + done );
+                }
+                ++c;
+            }
+            std::fill( data + done + copied, data + done + part, 0 );
+            done += part;
+        }
+        return length;
+    }
+
+    void write( const char *data, size_t offset, size_t length ) {
+        if ( offset + length > _size )
+            resize( offset + length );
+
+        while ( length ) {
+            size_t index = offset / _chunkSize;
+            size_t from = offset % _chunkSize;
+            size_t part = std::min( length, _chunkSize - from );
+
+            auto &c = *_chunks.emplace( index, Chunk() ).first;
+            char *target = _reserve( c, from + part );
+            std::copy( data, data + part, target + from );
+            if ( c.second.pinned ) {
+                c.second.hole = false;
+                _mirror( c, from, part );
+            }
+            else
+                _intern( c.second );
+            data += part;
+            offset += part;
+            length -= part;
+        }
+    }
+
+    void resize( size_t length ) {
+        size_t count = _count( _size );
+
+        // bytes stored through a mapping past the end are not part of the file
+        if ( length > _size && _size % _chunkSize ) {
+            auto c = _chunks.find( _size / _chunkSize );
+            if ( c != _chunks.end() && c->second.pinned )
+                _clearPinned( *c, _size % _chunkSize );
+        }
+
+        if ( length < _size ) {
+            _chunks.erase( _chunks.lower_bound( _count( length ) ), _chunks.end() );
+
+            // the tail of the last kept chunk has to read as zeros again
+            auto c = _chunks.find( length / _chunkSize );
+            size_t keep = length % _chunkSize;
+            if ( keep && c != _chunks.end() ) {
+                if ( c->second.snapshot )
+                    _detach( *c );
+                if ( c->second.pinned )
+                    _clearPinned( *c, keep );
+                else if ( c->second.data && c->second.data->size() > keep )
+                    _own( c->second ).resize( keep );
+            }
+        }
+        _size = length;
+
+        // chunks dropped while pinned get their pinned storage back
+        for ( auto &p : _pins ) {
+            size_t end = std::min( p.first + p.count, _count( _size ) );
+            for ( size_t i = std::max( p.first, count ); i < end; ++i )
+                _repin( i );
+        }
+    }
+
+    void clear() {
+        resize( 0 );
+    }
+
+    // offset of the first byte at or after offset which is not in a hole
+    size_t nextData( size_t offset ) const {
+        auto c = _chunks.lower_bound( offset / _chunkSize );
+        if ( c == _chunks.end() )
+            return _size;
+        return std::min( _size, std::max( offset, c->first * _chunkSize ) );
+    }
+
+    // offset of the first hole at or after offset; end of data is a hole too
+    size_t nextHole( size_t offset ) const {
+        size_t index = offset / _chunkSize;
+        for ( auto c = _chunks.lower_bound( index ); c != _chunks.end() && c->first == index; ++c )
+            ++index;
+        return std::min( _size, std::max( offset, index * _chunkSize ) );
+    }
+
+    // remembers the chunks covering the range; blocks are shared, not copied
+    Saved save( size_t offset, size_t length ) const {
+        Saved saved{ _size, offset / _chunkSize, _count( offset + length ) - offset / _chunkSize, {} };
+        for ( auto c = _chunks.lower_bound( saved.first ); c != _chunks.end() && c->first < saved.first + saved.count; ++c ) {
+            saved.chunks.emplace_back( *c );
+            // pinned buffers change in place, their bytes have to be copied
+            if ( c->second.pinned && !_unpinned( *c, saved.chunks.back().second ) )
+                saved.chunks.pop_back();
+        }
+        return saved;
+    }
+
+    // puts back the range and the size remembered by save()
+    void restore( const Saved &saved ) {
+        if ( saved.size > _size )
+            resize( saved.size );
+
+        auto s = saved.chunks.begin();
+        for ( size_t i = saved.first; i < saved.first + saved.count; ++i ) {
+            const Chunk *chunk = s != saved.chunks.end() && s->first == i ? &( s++ )->second : nullptr;
+            auto c = _chunks.find( i );
+            if ( c != _chunks.end() && c->second.pinned ) {
+                size_t available = 0;
+                const char *source = chunk ? _bytes( { i, *chunk }, available ) : nullptr;
+                std::copy( source, source + available, c->second.pinned );
+                std::fill( c->second.pinned + available, c->second.pinned + _chunkSize, 0 );
+                c->second.hole = !chunk;
+                _mirror( *c, 0, _chunkSize );
+            }
+            else if ( chunk )
+                _chunks[ i ] = *chunk;
+            else if ( c != _chunks.end() )
+                _chunks.erase( c );
+        }
+
+        if ( saved.size < _size )
+            resize( saved.size );
+    }
+
+    /*
+     * Returns a buffer holding the range. Only the chunks of the range are
+     * pinned; a range within a pinned one shares its buffer.
+     */
+    char *pin( size_t offset, size_t length ) {
+        size_t first = offset / _chunkSize;
+        size_t count = _count( offset + length ) - first;
+
+        for ( auto &p : _pins ) {
+            if ( p.first <= first && first + count <= p.first + p.count ) {
+                ++p.references;
+                return p.buffer.data() + offset - p.first * _chunkSize;
+            }
+        }
+
+        // the buffer joins the others once it holds the bytes
+        utils::List< Pin > pinned;
+        pinned.emplace_back( first, count, count * _chunkSize );
+        Pin &p = pinned.back();
+        for ( size_t i = first; i < first + count; ++i ) {
+            auto inserted = _chunks.emplace( i, Chunk() );
+            auto &c = *inserted.first;
+            char *buffer = p.buffer.data() + ( i - first ) * _chunkSize;
+            if ( c.second.pinned ) {
+                // all the buffers of the chunk start from the same bytes
+                _sync( c );
+                std::copy( c.second.pinned, c.second.pinned + _chunkSize, buffer );
+                if ( c.second.pins == 1 )
+                    c.second.data = std::allocate_shared< Block >( memory::Allocator< char, memory::Category::Content >(),
+                        c.second.pinned, c.second.pinned + _chunkSize );
+            }
+            else {
+                size_t available;
+                const char *source = _bytes( c, available );
+                std::copy( source, source + available, buffer );
+                c.second.data.reset();
+                c.second.interned = false;
+                c.second.snapshot = nullptr;
+                c.second.pinned = buffer;
+                c.second.hole = inserted.second;
+            }
+            ++c.second.pins;
+        }
+        _pins.splice( _pins.end(), pinned );
+        return p.buffer.data() + offset - first * _chunkSize;
+    }
+
+    void unpin( const char *pointer ) {
+        for ( auto p = _pins.begin(); p != _pins.end(); ++p ) {
+            const char *begin = p->buffer.data();
+            const char *end = begin + p->buffer.size();
+            if ( pointer < begin || pointer >= end )
+                continue;
+            if ( --p->references )
+                return;
+
+            auto c = _chunks.lower_bound( p->first );
+            while ( c != _chunks.end() && c->first < p->first + p->count ) {
+                Chunk &chunk = c->second;
+                if ( !chunk.pinned ) {
+                    ++c;
+                    continue;
+                }
+                _sync( *c );
+                if ( --chunk.pins ) {
+                    // the other buffers keep backing the chunk
+                    if ( chunk.pinned >= begin && chunk.pinned < end )
+                        _eachPinned( c->first, [&]( char *buffer ) {
+                            if ( buffer < begin || buffer >= end )
+                                chunk.pinned = buffer;
+                        } );
+                    if ( chunk.pins == 1 )
+                        chunk.data.reset();
+                    ++c;
+                }
+                else if ( _unpinned( *c, chunk ) ) {
+                    _intern( chunk );
+                    ++c;
+                }
+                else
+                    c = _chunks.erase( c );
+            }
+            _pins.erase( p );
+            return;
+        }
+    }
+
+    // changes made through the buffer returned by pin() reach the other buffers of its range
+    void sync( const char *pointer ) {
+        for ( const auto &p : _pins ) {
+            if ( pointer < p.buffer.data() || pointer >= p.buffer.data() + p.buffer.size() )
+                continue;
+            for ( auto c = _chunks.lower_bound( p.first ); c != _chunks.end() && c->first < p.first + p.count; ++c )
+                _sync( *c );
+            return;
+        }
+    }
+
+private:
+    using Table = utils::Map< size_t, Chunk >;
+
+    struct Pin {
+        Pin( size_t first, size_t count, size_t capacity ) :
+            first( first ),
+            count( count ),
+            references( 1 ),
+            buffer( capacity )
+        {}
+
+        size_t first;
+        size_t count;
+        unsigned references;
+        BlockStore::Block buffer;
+    };
+
+    const char *_bytes( const Table::value_type &c, size_t &available ) const {
+        if ( c.second.pinned ) {
+            available = _chunkSize;
+            return c.second.pinned;
+        }
+        if ( c.second.snapshot ) {
+            available = std::min( _chunkSize, _snapshotSize - c.first * _chunkSize );
+            return c.second.snapshot;
+        }
+        available = c.second.data ? c.second.data->size() : 0;
+        return c.second.data ? c.second.data->data() : nullptr;
+    }
+
+    // calls yield with the part backing the chunk of every buffer pinned over it
+    template< typename Yield >
+    void _eachPinned( size_t index, Yield yield ) {
+        for ( auto &p : _pins ) {
+            if ( p.first <= index && index < p.first + p.count )
+                yield( p.buffer.data() + ( index - p.first ) * _chunkSize );
+        }
+    }
+    template< typename Yield >
+    void _eachPinned( size_t index, Yield yield ) const {
+        for ( const auto &p : _pins ) {
+            if ( p.first <= index && index < p.first + p.count )
+                yield( p.buffer.data() + ( index - p.first ) * _chunkSize );
+        }
+    }
+
+    // bytes of a pinned chunk, changes made through any of its buffers included
+    void _current( const Table::value_type &c, char *data, size_t from, size_t length ) const {
+        if ( c.second.pins < 2 ) {
+            std::copy( c.second.pinned + from, c.second.pinned + from + length, data );
+            return;
+        }
+        const char *base = c.second.data->data() + from;
+        std::copy( base, base + length, data );
+        _eachPinned( c.first, [&]( const char *buffer ) {
+            buffer += from;
+            for ( size_t i = 0; i < length; ++i ) {
+                if ( buffer[ i ] != base[ i ] )
+                    data[ i ] = buffer[ i ];
+            }
+        } );
+    }
+
+    // the buffers of the chunk and its base get the changes made through the others
+    void _sync( Table::value_type &c ) {
+        if ( c.second.pins < 2 )
+            return;
+        Block &base = *c.second.data;
+        Block current( _chunkSize );
+        _current( c, current.data(), 0, _chunkSize );
+        std::copy( current.begin(), current.end(), base.begin() );
+        _eachPinned( c.first, [&]( char *buffer ) {
+            std::copy( current.begin(), current.end(), buffer );
+        } );
+    }
+
+    // bytes stored in place through one buffer of the chunk go to the others and its base
+    void _mirror( Table::value_type &c, size_t from, size_t length ) {
+        if ( c.second.pins < 2 )
+            return;
+        const char *source = c.second.pinned + from;
+        std::copy( source, source + length, c.second.data->data() + from );
+        _eachPinned( c.first, [&]( char *buffer ) {
+            if ( buffer != c.second.pinned )
+                std::copy( source, source + length, buffer + from );
+        } );
+    }
+
+    // the pinned chunk reads as zeros from the offset on
+    void _clearPinned( Table::value_type &c, size_t from ) {
+        std::fill( c.second.pinned + from, c.second.pinned + _chunkSize, 0 );
+        _mirror( c, from, _chunkSize - from );
+    }
+
+    // a chunk dropped while pinned is backed by its zeroed buffers again
+    void _repin( size_t index ) {
+        Chunk &c = _chunks[ index ] = Chunk();
+        c.hole = true;
+        _eachPinned( index, [&]( char *buffer ) {
+            std::fill( buffer, buffer + _chunkSize, 0 );
+            if ( !c.pinned )
+                c.pinned = buffer;
+            ++c.pins;
+        } );
+        if ( c.pins > 1 )
+            c.data = std::allocate_shared< Block >( memory::Allocator< char, memory::Category::Content >(), _chunkSize );
+    }
+
+    /*
+     * Turns the copy of a pinned chunk into a chunk holding its bytes. Returns
+     * false if there is nothing left to hold: the chunk is past the end or
+     * it was a hole and nothing but zeros was stored in it.
+     */
+    bool _unpinned( const Table::value_type &c, Chunk &copy ) const {
+        size_t backed = _backed( c.first );
+        Block bytes( backed );
+        _current( c, bytes.data(), 0, backed );
+        if ( !backed || ( c.second.hole && std::all_of( bytes.begin(), bytes.end(), []( char b ) { return !b; } ) ) )
+            return false;
+        copy = Chunk();
+        copy.data = std::allocate_shared< Block >( memory::Allocator< char, memory::Category::Content >(), std::move( bytes ) );
+        return true;
+    }
+
+    // block of the chunk which is not shared with any other storage
+    Block &_own( Chunk &c ) {
+        if ( !c.data )
+            c.data = std::allocate_shared< Block >( memory::Allocator< char, memory::Category::Content >() );
+        else if ( c.data.use_count() > 1 )
+            c.data = std::allocate_shared< Block >( memory::Allocator< char, memory::Category::Content >(), *c.data );
+        else if ( c.interned && _store )
+            _store->release( c.data, c.hash );
+        c.interned = false;
+        return *c.data;
+    }
+
+    // full blocks are shared with all equal blocks in the store
+    void _intern( Chunk &c ) {
+        if ( !_store || c.interned || c.pinned || !c.data || c.data->size() != _chunkSize )
+            return;
+        c.hash = BlockStore::hash( *c.data );
+        c.data = _store->intern( std::move( c.data ), c.hash );
+        c.interned = true;
+    }
+
+    void _detach( Table::value_type &c ) {
+        size_t available;
+        const char *source = _bytes( c, available );
+        c.second.snapshot = nullptr;
+        _own( c.second ).assign( source, source + available );
+    }
+
+    char *_reserve( Table::value_type &c, size_t length ) {
+        if ( c.second.pinned )
+            return c.second.pinned;
+        if ( c.second.snapshot )
+            _detach( c );
+        Block &block = _own( c.second );
+        if ( block.size() < length )
+            block.resize( length );
+        return block.data();
+    }
+
+    size_t _count( size_t length ) const {
+        return ( length + _chunkSize - 1 ) / _chunkSize;
+    }
+
+    size_t _backed( size_t index ) const {
+        return std::min( _chunkSize, _size - std::min( _size, index * _chunkSize ) );
+    }
+
+    Table _chunks;
+    std::shared_ptr< BlockStore > _store;
+    utils::List< Pin > _pins;
+    size_t _chunkSize;
+    size_t _size;
+    size_t _snapshotSize;
+};
+
 } // namespace storage
 } // namespace fs
 } // namespace divine
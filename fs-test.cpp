@@ -0,0 +1,533 @@
+// -*- C++ -*- (c) 2015 Jiří Weiser
+
+/*
+ * Native smoke test of the manager: builds and runs without DiVinE and
+ * exercises the parts of the file system which have tricky edge cases.
+ */
+#include <cstdio>
+#include <cstring>
+
+#include "fs-manager.h"
+
+using namespace divine::fs;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK( x )                                                          \
+    do {                                                                    \
+        if ( !( x ) ) {                                                     \
+            std::fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x ); \
+            ++failures;                                                     \
+        }                                                                   \
+    } while ( false )
+
+// the error thrown by f, 0 if there is none
+template< typename F >
+int error( F f ) {
+    try {
+        f();
+    } catch ( Error &e ) {
+        return e.code();
+    }
+    return 0;
+}
+
+const Flags< flags::Open > readWrite = flags::Open::Read | flags::Open::Write;
+
+int create( Manager &m, const char *name ) {
+    return m.openFileAt( CURRENT_DIRECTORY, name, readWrite | flags::Open::Create, Mode::RUSER | Mode::WUSER );
+}
+
+int open( Manager &m, const char *name ) {
+    return m.openFileAt( CURRENT_DIRECTORY, name, readWrite, 0 );
+}
+
+void write( Manager &m, int fd, const char *text, off_t offset ) {
+    m.lseek( fd, offset, Seek::Set );
+    m.tryWrite( fd, text, std::strlen( text ) ).value();
+}
+
+utils::String read( Manager &m, int fd, off_t offset, size_t length ) {
+    utils::String result( length, '\0' );
+    m.lseek( fd, offset, Seek::Set );
+    result.resize( m.tryRead( fd, &result[ 0 ], length ).value() );
+    return result;
+}
+
+bool exists( Manager &m, const char *name ) {
+    return bool( m.tryAccessAt( CURRENT_DIRECTORY, name, flags::Access::OK, flags::At::NoFlags ) );
+}
+
+void holes() {
+    Manager m;
+    int fd = create( m, "sparse" );
+    write( m, fd, "a", 0 );
+    write( m, fd, "b", 10 * FILE_CHUNK_SIZE );
+
+    CHECK( m.lseek( fd, 0, Seek::Data ) == 0 );
+    CHECK( m.lseek( fd, 0, Seek::Hole ) == FILE_CHUNK_SIZE );
+    CHECK( m.lseek( fd, FILE_CHUNK_SIZE, Seek::Data ) == 10 * FILE_CHUNK_SIZE );
+    CHECK( m.lseek( fd, 10 * FILE_CHUNK_SIZE, Seek::Hole ) == 10 * FILE_CHUNK_SIZE + 1 );
+    CHECK( read( m, fd, 5 * FILE_CHUNK_SIZE, 4 ) == utils::String( 4, '\0' ) );
+    CHECK( read( m, fd, 10 * FILE_CHUNK_SIZE, 4 ) == "b" );
+    m.closeFile( fd );
+}
+
+void cloneIsolation() {
+    Manager m;
+    int fd = create( m, "shared" );
+    write( m, fd, "one", 0 );
+    m.closeFile( create( m, "doomed" ) );
+
+    std::unique_ptr< Manager > c = m.clone();
+    write( *c, fd, "two", 0 );
+    c->removeFile( "doomed" );
+    m.closeFile( create( m, "fresh" ) );
+
+    CHECK( read( m, fd, 0, 3 ) == "one" );
+    CHECK( read( *c, fd, 0, 3 ) == "two" );
+    CHECK( exists( m, "doomed" ) );
+    CHECK( !exists( *c, "doomed" ) );
+    CHECK( exists( m, "fresh" ) );
+    CHECK( !exists( *c, "fresh" ) );
+
+    // a clone of the clone starts from the state of the clone
+    std::unique_ptr< Manager > cc = c->clone();
+    write( *cc, fd, "six", 0 );
+    CHECK( read( *c, fd, 0, 3 ) == "two" );
+    CHECK( read( *cc, fd, 0, 3 ) == "six" );
+    CHECK( read( m, fd, 0, 3 ) == "one" );
+}
+
+void arenas() {
+    std::unique_ptr< Manager > first( new Manager );
+    Manager second;
+    int fd = create( *first, "first" );
+    write( *first, fd, "one", 0 );
+    int other = create( second, "second" );
+    write( second, other, "two", 0 );
+
+    // the clone keeps the arena it shares with the first manager
+    std::unique_ptr< Manager > c = first->clone();
+    first.reset();
+    CHECK( read( *c, fd, 0, 3 ) == "one" );
+    c->closeFile( create( *c, "clone" ) );
+    c.reset();
+
+    // neither of them held objects of the second manager
+    second.closeFile( create( second, "third" ) );
+    CHECK( read( second, other, 0, 3 ) == "two" );
+    CHECK( exists( second, "third" ) );
+}
+
+void memoryStats() {
+#ifdef FS_MEMORY_STATS
+    Manager m;
+    Manager other;
+    size_t made = m.memoryStats().total().allocations;
+    size_t elsewhere = other.memoryStats().total().allocations;
+    size_t live = m.memoryStats()[ memory::Category::Nodes ].live;
+
+    int fd = create( m, "file" );
+    write( m, fd, "data", 0 );
+    CHECK( m.memoryStats().total().allocations > made );
+    CHECK( m.memoryStats()[ memory::Category::Nodes ].live == live + 1 );
+    CHECK( other.memoryStats().total().allocations == elsewhere );
+
+    m.closeFile( fd );
+    m.removeFile( "file" );
+    CHECK( m.memoryStats()[ memory::Category::Nodes ].live == live );
+
+    // clones share the arena and so the usage
+    std::unique_ptr< Manager > c = m.clone();
+    CHECK( &c->memoryStats() == &m.memoryStats() );
+#endif
+}
+
+void detachedCopies() {
+    Manager m;
+    int fd = create( m, "file" );
+    write( m, fd, "one", 0 );
+    m.closeFile( fd );
+
+    std::unique_ptr< Manager > c = m.clone();
+    int a = open( *c, "file" );
+    int b = open( *c, "file" );
+    write( *c, b, "two", 0 );
+    CHECK( read( *c, a, 0, 3 ) == "two" );
+
+    // the copy is no longer named, the descriptors keep it
+    auto mark = c->checkpoint();
+    c->removeFile( "file" );
+    write( *c, b, "six", 0 );
+    CHECK( read( *c, a, 0, 3 ) == "six" );
+
+    c->rollback( mark );
+    CHECK( exists( *c, "file" ) );
+    int d = open( *c, "file" );
+    CHECK( read( *c, d, 0, 3 ) == "two" );
+    CHECK( read( m, open( m, "file" ), 0, 3 ) == "one" );
+}
+
+void rollback() {
+    Manager m;
+    int fd = create( m, "kept" );
+    write( m, fd, "before", 0 );
+    m.closeFile( fd );
+
+    auto mark = m.checkpoint();
+    fd = open( m, "kept" );
+    write( m, fd, "after!", 0 );
+    m.closeFile( fd );
+    m.removeFile( "kept" );
+    m.closeFile( create( m, "added" ) );
+    m.rollback( mark );
+
+    CHECK( !exists( m, "added" ) );
+    CHECK( exists( m, "kept" ) );
+    fd = open( m, "kept" );
+    CHECK( read( m, fd, 0, 6 ) == "before" );
+    m.closeFile( fd );
+}
+
+void rollbackState() {
+    Manager m;
+    m.createNodeAt( CURRENT_DIRECTORY, "dir", Mode::DIR | Mode::RWXUSER );
+    int fd = create( m, "file" );
+    mode_t mask = m.umask();
+
+    auto mark = m.checkpoint();
+    m.tryWrite( fd, "abc", 3 ).value();
+    CHECK( m.lseek( fd, 0, Seek::Current ) == 3 );
+    m.changeDirectory( "dir" );
+    m.umask( 0 );
+    m.descriptorLimit( 2 * FILE_DESCRIPTOR_LIMIT );
+    m.rollback( mark );
+
+    CHECK( m.lseek( fd, 0, Seek::Current ) == 0 );
+    CHECK( m.lseek( fd, 0, Seek::End ) == 0 );
+    CHECK( exists( m, "file" ) );
+    CHECK( m.umask() == mask );
+    CHECK( m.descriptorLimit() == size_t( FILE_DESCRIPTOR_LIMIT ) );
+
+    // positional reads and writes leave the position alone
+    mark = m.checkpoint();
+    m.tryWrite( fd, "xyz", 3, 10 ).value();
+    char buffer[ 3 ];
+    CHECK( m.tryRead( fd, buffer, 3, 10 ).value() == 3 );
+    CHECK( m.lseek( fd, 0, Seek::Current ) == 0 );
+    m.rollback( mark );
+    CHECK( m.lseek( fd, 0, Seek::End ) == 0 );
+}
+
+void cloneRollback() {
+    Manager m;
+    int fd = create( m, "data" );
+    write( m, fd, "kept", 0 );
+
+    auto mark = m.checkpoint();
+    m.closeFile( create( m, "a" ) );
+    write( m, fd, "lost", 0 );
+    m.removeFile( "data" );
+    std::unique_ptr< Manager > c = m.clone();
+    m.rollback( mark );
+
+    // the clone keeps the state it was made in
+    CHECK( exists( *c, "a" ) );
+    CHECK( !exists( *c, "data" ) );
+    CHECK( read( *c, fd, 0, 4 ) == "lost" );
+
+    CHECK( !exists( m, "a" ) );
+    CHECK( exists( m, "data" ) );
+    CHECK( read( m, fd, 0, 4 ) == "kept" );
+    CHECK( read( m, open( m, "data" ), 0, 4 ) == "kept" );
+}
+
+void largeDirectory() {
+    const int count = 4 * DIRECTORY_INDEX_THRESHOLD;
+    Manager m;
+    m.createNodeAt( CURRENT_DIRECTORY, "big", Mode::DIR | Mode::RWXUSER );
+    char name[ 32 ];
+    for ( int i = 0; i < count; ++i ) {
+        std::snprintf( name, sizeof( name ), "big/f%d", i );
+        m.closeFile( create( m, name ) );
+    }
+    for ( int i = 0; i < count; i += 2 ) {
+        std::snprintf( name, sizeof( name ), "big/f%d", i );
+        m.removeFile( name );
+    }
+    for ( int i = 0; i < count; ++i ) {
+        std::snprintf( name, sizeof( name ), "big/f%d", i );
+        CHECK( exists( m, name ) == bool( i % 2 ) );
+    }
+
+    int fd = m.openFileAt( CURRENT_DIRECTORY, "big", flags::Open::Read, 0 );
+    int entries = 0;
+    m.readDirectory( fd, [&]( const Name &, Node, long ) {
+        ++entries;
+        return true;
+    } );
+    // with "." and ".."
+    CHECK( entries == count / 2 + 2 );
+    m.closeFile( fd );
+}
+
+void dentryCache() {
+    const int count = 2 * DENTRY_CACHE_LIMIT;
+    Manager m;
+    m.createNodeAt( CURRENT_DIRECTORY, "dir", Mode::DIR | Mode::RWXUSER );
+    char name[ 32 ];
+    for ( int i = 0; i < count; ++i ) {
+        std::snprintf( name, sizeof( name ), "dir/f%d", i );
+        m.closeFile( create( m, name ) );
+    }
+    // more names than slots, and every one of them twice
+    for ( int round = 0; round < 2; ++round ) {
+        for ( int i = 0; i < count; ++i ) {
+            std::snprintf( name, sizeof( name ), "dir/f%d", i );
+            CHECK( exists( m, name ) );
+            std::snprintf( name, sizeof( name ), "dir/g%d", i );
+            CHECK( !exists( m, name ) );
+        }
+    }
+
+    // negative entries go away with the name created, positive ones with the name removed
+    CHECK( !exists( m, "dir/new" ) );
+    m.closeFile( create( m, "dir/new" ) );
+    CHECK( exists( m, "dir/new" ) );
+    m.removeFile( "dir/new" );
+    CHECK( !exists( m, "dir/new" ) );
+
+    // entries of a removed directory are dropped with it
+    m.createNodeAt( CURRENT_DIRECTORY, "gone", Mode::DIR | Mode::RWXUSER );
+    m.closeFile( create( m, "gone/file" ) );
+    CHECK( exists( m, "gone/file" ) );
+    m.removeFile( "gone/file" );
+    m.removeDirectory( "gone" );
+    CHECK( !exists( m, "gone/file" ) );
+    CHECK( !exists( m, "gone" ) );
+}
+
+void descriptors() {
+    Manager m;
+    int fd = create( m, "file" );
+    CHECK( error( [&] { m.duplicate2( fd, FILE_DESCRIPTOR_LIMIT ); } ) == EBADF );
+
+    const int high = FILE_DESCRIPTOR_HARD_LIMIT - 1;
+    m.descriptorLimit( FILE_DESCRIPTOR_HARD_LIMIT );
+    CHECK( m.duplicate2( fd, high ) == high );
+    CHECK( m.duplicate( fd ) == fd + 1 );
+    CHECK( error( [&] { m.duplicate( fd, high ); } ) == EMFILE );
+    m.closeFile( fd + 1 );
+    CHECK( m.duplicate( fd, 4096 ) == 4096 );
+
+    // descriptors above a lowered limit stay open
+    m.descriptorLimit( FILE_DESCRIPTOR_LIMIT );
+    CHECK( read( m, high, 0, 1 ).empty() );
+    CHECK( m.duplicate( fd ) == fd + 1 );
+    m.closeFile( high );
+    m.closeFile( 4096 );
+    CHECK( error( [&] { m.closeFile( high ); } ) == EBADF );
+
+    // raising the limit again finds the descriptors left open above it
+    m.descriptorLimit( FILE_DESCRIPTOR_HARD_LIMIT );
+    CHECK( m.duplicate2( fd, 5000 ) == 5000 );
+    m.descriptorLimit( 4000 );
+    m.descriptorLimit( 6000 );
+    CHECK( m.duplicate( fd, 5000 ) == 5001 );
+}
+
+void directoryStreams() {
+    Manager m;
+    m.createNodeAt( CURRENT_DIRECTORY, "dir", Mode::DIR | Mode::RWXUSER );
+    void *first = m.openDirectory( m.openFileAt( CURRENT_DIRECTORY, "dir", flags::Open::Read, 0 ) );
+    m.closeDirectory( first );
+
+    // the slot is reused, the stale handle must not reach the new stream
+    void *second = m.openDirectory( m.openFileAt( CURRENT_DIRECTORY, "dir", flags::Open::Read, 0 ) );
+    CHECK( second != first );
+    CHECK( error( [&] { m.getDirectory( first ); } ) == EBADF );
+    CHECK( error( [&] { m.closeDirectory( first ); } ) == EBADF );
+    CHECK( !error( [&] { m.getDirectory( second ); } ) );
+    m.closeDirectory( second );
+    CHECK( error( [&] { m.getDirectory( nullptr ); } ) == EBADF );
+
+    for ( const char *name : { "a", "b", "c", "d" } )
+        m.closeFile( create( m, ( utils::String( "dir/" ) + name ).c_str() ) );
+    void *stream = m.openDirectory( m.openFileAt( CURRENT_DIRECTORY, "dir", flags::Open::Read, 0 ) );
+    DirectoryDescriptor *dd = m.getDirectory( stream );
+    // hands the next entry over to the stream as readdir() does
+    utils::String last;
+    auto next = [&] {
+        last.clear();
+        m.readDirectory( dd->fd(), [&]( const Name &name, Node, long long offset ) {
+            if ( !last.empty() )
+                return false;
+            last = name.str();
+            dd->advance( 0, last.c_str(), offset );
+            return true;
+        } );
+        return last;
+    };
+    while ( next() != "b" )
+        ;
+    long cookie = m.tellDirectory( stream );
+    CHECK( m.tellDirectory( stream ) == cookie );
+    CHECK( next() == "c" );
+
+    // the cookie follows "b" whatever happens to the entries around it
+    m.closeFile( create( m, "dir/bb" ) );
+    m.removeFile( "dir/a" );
+    m.removeFile( "dir/c" );
+    m.seekDirectory( stream, cookie );
+    CHECK( m.tellDirectory( stream ) == cookie );
+    CHECK( next() == "bb" );
+    CHECK( next() == "d" );
+    CHECK( next() == "" );
+
+    m.seekDirectory( stream, 0 );
+    CHECK( next() == "." );
+    CHECK( error( [&] { m.seekDirectory( stream, cookie + 1 ); } ) == EINVAL );
+    m.closeDirectory( stream );
+}
+
+void partialMappings() {
+    const off_t page = 4096;
+    Manager m;
+    int fd = create( m, "mapped" );
+    m.truncate( m.getFile( fd )->inode(), 3 * page );
+
+    char *p = static_cast< char * >( m.mmap( fd, 3 * page, 0, flags::Mapping::MapShared ) );
+    CHECK( p );
+    std::strcpy( p + 2 * page, "mapped" );
+    CHECK( read( m, fd, 2 * page, 6 ) == "mapped" );
+
+    m.munmap( p + page, page );
+    CHECK( !error( [&] { m.msync( p, page ); } ) );
+    CHECK( error( [&] { m.msync( p + page, page ); } ) == ENOMEM );
+    CHECK( error( [&] { m.msync( p, 3 * page ); } ) == ENOMEM );
+    CHECK( !error( [&] { m.mprotect( p + 2 * page, page, flags::Protection::Read ); } ) );
+    CHECK( error( [&] { m.mprotect( p, 2 * page, flags::Protection::Read ); } ) == ENOMEM );
+
+    m.munmap( p, 3 * page );
+    CHECK( error( [&] { m.msync( p, page ); } ) == ENOMEM );
+    CHECK( read( m, fd, 2 * page, 6 ) == "mapped" );
+
+    // a nested shared mapping aliases the first one, each munmap drops one of them
+    p = static_cast< char * >( m.mmap( fd, 2 * page, 0, flags::Mapping::MapShared ) );
+    CHECK( m.mmap( fd, page, 0, flags::Mapping::MapShared ) == p );
+    m.munmap( p, page );
+    CHECK( !error( [&] { m.msync( p, 2 * page ); } ) );
+    std::strcpy( p, "alias" );
+    CHECK( read( m, fd, 0, 5 ) == "alias" );
+    m.munmap( p, 2 * page );
+    CHECK( error( [&] { m.msync( p, page ); } ) == ENOMEM );
+    CHECK( error( [&] { m.mprotect( p, page, flags::Protection::Read ); } ) == ENOMEM );
+
+    // identical mappings are unmapped one by one
+    p = static_cast< char * >( m.mmap( fd, page, 0, flags::Mapping::MapShared ) );
+    CHECK( m.mmap( fd, page, 0, flags::Mapping::MapShared ) == p );
+    m.munmap( p, page );
+    std::strcpy( p, "still" );
+    CHECK( read( m, fd, 0, 5 ) == "still" );
+    m.munmap( p, page );
+    CHECK( error( [&] { m.msync( p, page ); } ) == ENOMEM );
+    CHECK( read( m, fd, 0, 5 ) == "still" );
+    m.closeFile( fd );
+}
+
+void overlappingMappings() {
+    const off_t page = 4096;
+    Manager m;
+    int fd = create( m, "db" );
+    m.truncate( m.getFile( fd )->inode(), 3 * page );
+
+    // overlapping windows have buffers of their own, msync brings them together
+    char *p = static_cast< char * >( m.mmap( fd, 2 * page, 0, flags::Mapping::MapShared ) );
+    char *q = static_cast< char * >( m.mmap( fd, 2 * page, page, flags::Mapping::MapShared ) );
+    CHECK( q != p + page );
+    std::strcpy( q, "page" );
+    CHECK( read( m, fd, page, 4 ) == "page" );
+    m.msync( q, page );
+    CHECK( !std::strcmp( p + page, "page" ) );
+    write( m, fd, "data", page + 4 );
+    CHECK( !std::strcmp( q, "pagedata" ) );
+    CHECK( !std::strcmp( p + page, "pagedata" ) );
+
+    // a window within a pinned one shares its buffer
+    char *r = static_cast< char * >( m.mmap( fd, page, page, flags::Mapping::MapShared ) );
+    CHECK( r == p + page );
+    m.munmap( p, 2 * page );
+    CHECK( !error( [&] { m.msync( r, page ); } ) );
+    std::strcpy( r + 8, "!" );
+    m.munmap( r, page );
+    m.munmap( q, 2 * page );
+    CHECK( read( m, fd, page, 9 ) == "pagedata!" );
+    m.closeFile( fd );
+
+    // the file grows under a mapping and gets mapped again
+    fd = create( m, "grown" );
+    m.truncate( m.getFile( fd )->inode(), page );
+    char *small = static_cast< char * >( m.mmap( fd, page, 0, flags::Mapping::MapShared ) );
+    m.truncate( m.getFile( fd )->inode(), 4 * page );
+    char *large = static_cast< char * >( m.mmap( fd, 4 * page, 0, flags::Mapping::MapShared ) );
+    CHECK( large );
+    std::strcpy( large + 3 * page, "tail" );
+    std::strcpy( small, "head" );
+    m.msync( small, page );
+    CHECK( !std::strcmp( large, "head" ) );
+    m.munmap( small, page );
+    m.munmap( large, 4 * page );
+    CHECK( read( m, fd, 0, 4 ) == "head" );
+    CHECK( read( m, fd, 3 * page, 4 ) == "tail" );
+    m.closeFile( fd );
+}
+
+void sparseMappings() {
+    const off_t page = 4096;
+    const off_t size = 64 * 1024 * 1024;
+    Manager m;
+    int fd = create( m, "sparse" );
+    m.truncate( m.getFile( fd )->inode(), size );
+
+    // only the mapped page is pinned, it is a hole again once unmapped
+    char *p = static_cast< char * >( m.mmap( fd, page, size / 2, flags::Mapping::MapShared ) );
+    CHECK( p && !p[ 0 ] );
+    m.munmap( p, page );
+    CHECK( m.lseek( fd, 0, Seek::Hole ) == 0 );
+    CHECK( error( [&] { m.lseek( fd, 0, Seek::Data ); } ) == ENXIO );
+
+    // what is stored through the mapping stays
+    p = static_cast< char * >( m.mmap( fd, page, size / 2, flags::Mapping::MapShared ) );
+    p[ 1 ] = 'x';
+    m.munmap( p, page );
+    CHECK( m.lseek( fd, 0, Seek::Data ) == size / 2 );
+    CHECK( m.lseek( fd, size / 2, Seek::Hole ) == size / 2 + FILE_CHUNK_SIZE );
+    CHECK( read( m, fd, size / 2, 2 ) == utils::String( "\0x", 2 ) );
+    m.closeFile( fd );
+}
+
+} // namespace
+
+int main() {
+    holes();
+    cloneIsolation();
+    arenas();
+    memoryStats();
+    detachedCopies();
+    rollback();
+    rollbackState();
+    cloneRollback();
+    largeDirectory();
+    dentryCache();
+    descriptors();
+    directoryStreams();
+    partialMappings();
+    overlappingMappings();
+    sparseMappings();
+    if ( failures )
+        std::fprintf( stderr, "%d checks failed\n", failures );
+    return failures ? 1 : 0;
+}
@@ -8,12 +8,14 @@
 #include <string>
 #include <queue>
 #include <set>
+#include <map>
 #include <list>
 #include <unordered_map>
 #include <utility>
 #include <algorithm>
 #include <type_traits>
 #include <cerrno>
+#include <cstdint>
 
 #include "fs-memory.h"
 
@@ -131,15 +133,15 @@ using is_enum_class = std::integral_constant< bool,
         std::is_enum< E >::value && !std::is_convertible< E, int >::value >;
 
 
-template< typename Type, typename... Args >
-auto constructIfPossible( Args &&... args )
+template< typename Type, typename Target, typename... Args >
+auto emplaceIfPossible( Target &target, Args &&... args )
     -> typename std::enable_if< std::is_constructible< Type, Args... >::value, Type * >::type
 {
-    return new( memory::nofail ) Type( std::forward< Args >( args )... );
+    return target.template emplace< Type >( std::forward< Args >( args )... );
 }
 
-template< typename Type, typename... Args >
-auto constructIfPossible( Args &&... args )
+template< typename Type, typename Target, typename... Args >
+auto emplaceIfPossible( Target &, Args &&... args )
     -> typename std::enable_if< !std::is_constructible< Type, Args... >::value, Type * >::type
 {
     return nullptr;
@@ -160,6 +162,13 @@ using Queue = std::queue< T, Deque< T > >;
 template< typename T >
 using Set = std::set< T, std::less< T >, memory::Allocator< T > >;
 
+template< typename Key, typename Value >
+using Map = std::map<
+    Key,
+    Value,
+    std::less< Key >,
+    memory::Allocator< std::pair< const Key, Value > > >;
+
 template< typename T >
 using List = std::list< T, memory::Allocator< T > >;
 
@@ -171,6 +180,123 @@ using UnorderedMap = std::unordered_map<
     std::equal_to< Key >,
     memory::Allocator< std::pair< const Key, Value > > >;
 
+// FNV-1a
+inline uint64_t hash( const char *data, size_t length, uint64_t seed = 14695981039346656037ull ) {
+    for ( const char *end = data + length; data != end; ++data ) {
+        seed ^= static_cast< unsigned char >( *data );
+        seed *= 1099511628211ull;
+    }
+    return seed;
+}
+
+/*
+ * Set of used slots below a limit. Each level of the bitmap marks the full
+ * words of the level below, so the lowest free slot from any bound is found
+ * with one word lookup per level. Words are kept only while some of their
+ * bits are set, so slots which are not used cost nothing.
+ */
+struct SlotBitmap {
+    static const size_t NONE = size_t( -1 );
+
+    explicit SlotBitmap( size_t limit = 0 ) :
+        _limit( 0 )
+    {
+        resize( limit );
+    }
+
+    size_t limit() const {
+        return _limit;
+    }
+
+    // slots below both limits keep their state
+    void resize( size_t limit ) {
+        Vector< size_t > kept;
+        if ( !_levels.empty() ) {
+            for ( const auto &word : _levels.front() ) {
+                for ( uint64_t bits = word.second; bits; bits &= bits - 1 ) {
+                    size_t slot = word.first * 64 + __builtin_ctzll( bits );
+                    if ( slot < limit )
+                        kept.push_back( slot );
+                }
+            }
+        }
+
+        _limit = limit;
+        _levels.clear();
+        size_t count = limit;
+        do {
+            count = ( count + 63 ) / 64;
+            _levels.emplace_back();
+        } while ( count > 1 );
+
+        for ( size_t slot : kept )
+            set( slot );
+    }
+
+    bool test( size_t slot ) const {
+        return slot >= _limit || _word( 0, slot / 64 ) & ( 1ull << ( slot % 64 ) );
+    }
+
+    void set( size_t slot ) {
+        for ( auto &level : _levels ) {
+            uint64_t &word = level[ slot / 64 ];
+            word |= 1ull << ( slot % 64 );
+            if ( word != ~0ull )
+                return;
+            slot /= 64;
+        }
+    }
+
+    void reset( size_t slot ) {
+        for ( auto &level : _levels ) {
+            auto word = level.find( slot / 64 );
+            if ( word == level.end() )
+                return;
+            bool full = word->second == ~0ull;
+            word->second &= ~( 1ull << ( slot % 64 ) );
+            if ( !word->second )
+                level.erase( word );
+            if ( !full )
+                return;
+            slot /= 64;
+        }
+    }
+
+    // the lowest free slot not below the bound, NONE if there is none
+    size_t lowest( size_t from = 0 ) const {
+        size_t slot = _lowest( 0, from );
+        return slot < _limit ? slot : NONE;
+    }
+
+private:
+    using Level = Map< size_t, uint64_t >;
+
+    uint64_t _word( size_t level, size_t word ) const {
+        auto w = _levels[ level ].find( word );
+        return w == _levels[ level ].end() ? 0 : w->second;
+    }
+
+    // free slots past the limit may be returned, lowest() drops them
+    size_t _lowest( size_t level, size_t from ) const {
+        size_t word = from / 64;
+        if ( level + 1 == _levels.size() && word )
+            return NONE;
+        uint64_t free = ~_word( level, word ) & ( ~0ull << ( from % 64 ) );
+        if ( !free ) {
+            if ( level + 1 == _levels.size() )
+                return NONE;
+            word = _lowest( level + 1, word + 1 );
+            if ( word == NONE )
+                return NONE;
+            free = ~_word( level, word );
+        }
+        return word * 64 + __builtin_ctzll( free );
+    }
+
+    size_t _limit;
+    Vector< Level > _levels;
+};
+
 } // namespace utils
 
 struct Error {
@@ -185,6 +311,73 @@ private:
     int _code;
 };
 
+/*
+ * Either a value or an error code. Used where failures are common enough
+ * that throwing Error would cost too much; a failed result sets errno the
+ * same way Error does.
+ */
+template< typename T >
+struct Result {
+    Result( T value ) :
+        _value( std::move( value ) ),
+        _code( 0 )
+    {}
+    Result( Error error ) :
+        _value(),
+        _code( error.code() )
+    {}
+
+    explicit operator bool() const {
+        return !_code;
+    }
+    int error() const {
+        return _code;
+    }
+
+    // throws the error if there is no value
+    T &value() {
+        if ( _code )
+            throw Error( _code );
+        return _value;
+    }
+
+    T &operator*() {
+        return _value;
+    }
+    T *operator->() {
+        return &_value;
+    }
+
+private:
+    T _value;
+    int _code;
+};
+
+template<>
+struct Result< void > {
+    Result() :
+        _code( 0 )
+    {}
+    Result( Error error ) :
+        _code( error.code() )
+    {}
+
+    explicit operator bool() const {
+        return !_code;
+    }
+    int error() const {
+        return _code;
+    }
+
+    void value() const {
+        if ( _code )
+            throw Error( _code );
+    }
+
+private:
+    int _code;
+};
+
 } // namespace fs
 } // namespace divine
 
@@ -8,6 +8,7 @@
 
 #include "bits/types.h"
 #include "sys/stat.h"
+#include "sys/resource.h"
 #include "unistd.h"
 #include "dirent.h"
 #include "fcntl.h"
@@ -98,8 +99,17 @@ divine::fs::Flags< Mapping > map( int fls ) {
     divine::fs::Flags< Mapping > f;
 
     if ( fls & MAP_ANON )  { f |= Mapping::MapAnon; }
-    if ( fls & MAP_PRIVATE ) {  f |= Mapping::MapPrivate; }
+    // MAP_PRIVATE is zero, private is whatever is not shared
     if ( fls & MAP_SHARED )    {   f |= Mapping::MapShared; }
+    else                       {   f |= Mapping::MapPrivate; }
+    return f;
+}
+divine::fs::Flags< Protection > protection( int prot ) {
+    divine::fs::Flags< Protection > f = Protection::None;
+
+    if ( prot & PROT_READ )  f |= Protection::Read;
+    if ( prot & PROT_WRITE ) f |= Protection::Write;
+    if ( prot & PROT_EXEC )  f |= Protection::Exec;
     return f;
 }
 
@@ -121,7 +131,7 @@ static int _fillStat( const divine::fs::Node item, struct stat *buf ) {
     _initStat( buf );
     buf->st_ino = item->ino();
     buf->st_mode = item->mode();
-    buf->st_nlink = item.use_count();
+    buf->st_nlink = item->links();
     buf->st_size = item->size();
     buf->st_uid = item->uid();
     buf->st_gid = item->gid();
@@ -144,7 +154,8 @@ int openat( int dirfd, const char *path, int flags, ... ) {
     }
 
     try {
-        return vfs.instance().openFileAt( dirfd, path, conversion::open( flags ), m );
+        auto fd = vfs.instance().tryOpenFileAt( dirfd, path, conversion::open( flags ), m );
+        return fd ? *fd : -1;
     } catch ( Error & ) {
         return -1;
     }
@@ -238,8 +249,8 @@ int close( int fd ) {
 ssize_t write( int fd, const void *buf, size_t count ) {
     FS_ENTRYPOINT();
     try {
-        auto f = vfs.instance().getFile( fd );
-        return f->write( buf, count );
+        auto written = vfs.instance().tryWrite( fd, buf, count );
+        return written ? *written : -1;
     } catch ( Error & ) {
         return -1;
     }
@@ -247,11 +258,8 @@ ssize_t write( int fd, const void *buf, size_t count ) {
 ssize_t pwrite( int fd, const void *buf, size_t count, off_t offset ) {
     FS_ENTRYPOINT();
     try {
-        auto f = vfs.instance().getFile( fd );
-        size_t savedOffset = f->offset();
-        f->offset( offset );
-        auto d = divine::fs::utils::make_defer( [&]{ f->offset( savedOffset ); } );
-        return f->write( buf, count );
+        auto written = vfs.instance().tryWrite( fd, buf, count, offset );
+        return written ? *written : -1;
     } catch ( Error & ) {
         return -1;
     }
@@ -260,8 +268,8 @@ ssize_t pwrite( int fd, const void *buf, size_t count, off_t offset ) {
 ssize_t read( int fd, void *buf, size_t count ) {
     FS_ENTRYPOINT();
     try {
-        auto f = vfs.instance().getFile( fd );
-        return f->read( buf, count );
+        auto result = vfs.instance().tryRead( fd, buf, count );
+        return result ? *result : -1;
     } catch ( Error & ) {
         return -1;
     }
@@ -269,11 +277,8 @@ ssize_t read( int fd, void *buf, size_t count ) {
 ssize_t pread( int fd, void *buf, size_t count, off_t offset ) {
     FS_ENTRYPOINT();
     try {
-        auto f = vfs.instance().getFile( fd );
-        size_t savedOffset = f->offset();
-        f->offset( offset );
-        auto d = divine::fs::utils::make_defer( [&]{ f->offset( savedOffset ); } );
-        return f->read( buf, count );
+        auto result = vfs.instance().tryRead( fd, buf, count, offset );
+        return result ? *result : -1;
     } catch ( Error & ) {
         return -1;
     }
@@ -376,6 +381,12 @@ off_t lseek( int fd, off_t offset, int whence ) {
         case SEEK_END:
             w = divine::fs::Seek::End;
             break;
+        case SEEK_DATA:
+            w = divine::fs::Seek::Data;
+            break;
+        case SEEK_HOLE:
+            w = divine::fs::Seek::Hole;
+            break;
         }
         return vfs.instance().lseek( fd, offset, w );
     } catch ( Error & ) {
@@ -398,6 +409,41 @@ int dup2( int oldfd, int newfd ) {
         return -1;
     }
 }
+
+int getrlimit( int resource, struct rlimit *rlimits ) {
+    FS_ENTRYPOINT();
+    try {
+        if ( resource < 0 || resource >= RLIMIT_NLIMITS )
+            throw Error( EINVAL );
+        // resources which are not modelled have no limit
+        if ( resource != RLIMIT_NOFILE ) {
+            rlimits->rlim_cur = rlimits->rlim_max = RLIM_INFINITY;
+            return 0;
+        }
+        rlimits->rlim_cur = vfs.instance().descriptorLimit();
+        rlimits->rlim_max = divine::fs::FILE_DESCRIPTOR_HARD_LIMIT;
+        return 0;
+    } catch ( Error & ) {
+        return -1;
+    }
+}
+int setrlimit( int resource, const struct rlimit *rlimits ) {
+    FS_ENTRYPOINT();
+    try {
+        if ( resource < 0 || resource >= RLIMIT_NLIMITS || rlimits->rlim_cur > rlimits->rlim_max )
+            throw Error( EINVAL );
+        // limits of resources which are not modelled are accepted and not enforced
+        if ( resource != RLIMIT_NOFILE )
+            return 0;
+        // the hard limit itself is fixed
+        if ( rlimits->rlim_max > divine::fs::FILE_DESCRIPTOR_HARD_LIMIT )
+            throw Error( EPERM );
+        vfs.instance().descriptorLimit( rlimits->rlim_cur );
+        return 0;
+    } catch ( Error & ) {
+        return -1;
+    }
+}
 int symlinkat( const char *target, int dirfd, const char *linkpath ) {
     FS_ENTRYPOINT();
     try {
@@ -459,8 +505,7 @@ int faccessat( int dirfd, const char *path, int mode, int flags ) {
         fl |= divine::fs::flags::At::Invalid;
 
     try {
-        vfs.instance().accessAt( dirfd, path, m, fl );
-        return 0;
+        return vfs.instance().tryAccessAt( dirfd, path, m, fl ) ? 0 : -1;
     } catch ( Error & ) {
         return -1;
     }
@@ -473,10 +518,14 @@ int access( const char *path, int mode ) {
 int stat( const char *path, struct stat *buf ) {
     FS_ENTRYPOINT();
     try {
-        auto item = vfs.instance().findDirectoryItem( path );
+        auto item = vfs.instance().tryFindDirectoryItem( path );
         if ( !item )
-            throw Error( ENOENT );
-        return _fillStat( item, buf );
+            return -1;
+        if ( !*item ) {
+            errno = ENOENT;
+            return -1;
+        }
+        return _fillStat( *item, buf );
     } catch ( Error & ) {
         return -1;
     }
@@ -485,10 +534,14 @@ int stat( const char *path, struct stat *buf ) {
 int lstat( const char *path, struct stat *buf ) {
     FS_ENTRYPOINT();
     try {
-        auto item = vfs.instance().findDirectoryItem( path, false );
+        auto item = vfs.instance().tryFindDirectoryItem( path, false );
         if ( !item )
-            throw Error( ENOENT );
-        return _fillStat( item, buf );
+            return -1;
+        if ( !*item ) {
+            errno = ENOENT;
+            return -1;
+        }
+        return _fillStat( *item, buf );
     } catch ( Error & ) {
         return -1;
     }
@@ -497,8 +550,10 @@ int lstat( const char *path, struct stat *buf ) {
 int fstat( int fd, struct stat *buf ) {
     FS_ENTRYPOINT();
     try {
-        auto item = vfs.instance().getFile( fd );
-        return _fillStat( item->inode(), buf );
+        auto item = vfs.instance().tryGetFile( fd );
+        if ( !item )
+            return -1;
+        return _fillStat( ( *item )->inode(), buf );
     } catch ( Error & ) {
         return -1;
     }
@@ -679,6 +734,63 @@ int fchmod( int fd, mode_t mode ) {
     }
 }
 #if defined(__divine__)
+static unsigned char _directoryType( const divine::fs::Node &inode ) {
+    if ( !inode )
+        return DT_UNKNOWN;
+    auto mode = inode->mode();
+    if ( mode.isFile() )            return DT_REG;
+    if ( mode.isDirectory() )       return DT_DIR;
+    if ( mode.isLink() )            return DT_LNK;
+    if ( mode.isFifo() )            return DT_FIFO;
+    if ( mode.isSocket() )          return DT_SOCK;
+    if ( mode.isCharacterDevice() ) return DT_CHR;
+    if ( mode.isBlockDevice() )     return DT_BLK;
+    return DT_UNKNOWN;
+}
+
+// packs as many records as fit into the buffer
+static size_t _readDirectory( int fd, char *buffer, size_t length ) {
+    const size_t align = alignof( struct linux_dirent64 );
+    size_t used = 0;
+    bool left = vfs.instance().readDirectory( fd, [&]( const divine::fs::Name &name, divine::fs::Node inode, long long offset ) {
+        size_t reclen = offsetof( struct linux_dirent64, d_name ) + name.size() + 1;
+        reclen = ( reclen + align - 1 ) / align * align;
+        if ( length - used < reclen )
+            return false;
+
+        auto *record = reinterpret_cast< struct linux_dirent64 * >( buffer + used );
+        record->d_ino = inode ? inode->ino() : 0;
+        record->d_off = offset;
+        record->d_reclen = reclen;
+        record->d_type = _directoryType( inode );
+        *std::copy( name.begin(), name.end(), record->d_name ) = '\0';
+        used += reclen;
+        return true;
+    } );
+    if ( left && !used )
+        throw Error( EINVAL );
+    return used;
+}
+
+// the next entry of the stream, the buffer is refilled once it runs out
+static struct dirent *_nextEntry( divine::fs::DirectoryDescriptor *dir ) {
+    if ( !dir->current() )
+        dir->fill( _readDirectory( dir->fd(), dir->buffer(), dir->capacity() ) );
+    auto *entry = reinterpret_cast< struct dirent * >( dir->current() );
+    if ( entry )
+        dir->advance( entry->d_reclen, entry->d_name, entry->d_off );
+    return entry;
+}
+
+ssize_t getdents64( int fd, void *dirp, size_t count ) {
+    FS_ENTRYPOINT();
+    try {
+        return _readDirectory( fd, static_cast< char * >( dirp ), count );
+    } catch ( Error & ) {
+        return -1;
+    }
+}
+
 int alphasort( const struct dirent **a, const struct dirent **b ) {
     return std::strcoll( (*a)->d_name, (*b)->d_name );
 }
@@ -725,18 +837,8 @@ DIR *opendir( const char *path ) {
 
 struct dirent *readdir( DIR *dirp ) {
     FS_ENTRYPOINT();
-    static struct dirent entry;
-
     try {
-        auto dir = vfs.instance().getDirectory( dirp );
-        auto ent = dir->get();
-        if ( !ent )
-            return nullptr;
-        entry.d_ino = ent->ino();
-        char *x = std::copy( ent->name().begin(), ent->name().end(), entry.d_name );
-        *x = '\0';
-        dir->next();
-        return &entry;
+        return _nextEntry( vfs.instance().getDirectory( dirp ) );
     } catch ( Error & ) {
         return nullptr;
     }
@@ -746,14 +848,10 @@ int readdir_r( DIR *dirp, struct dirent *entry, struct dirent **result ) {
     FS_ENTRYPOINT();
 
     try {
-        auto dir = vfs.instance().getDirectory( dirp );
-        auto ent = dir->get();
+        struct dirent *ent = _nextEntry( vfs.instance().getDirectory( dirp ) );
         if ( ent ) {
-            entry->d_ino = ent->ino();
-            char *x = std::copy( ent->name().begin(), ent->name().end(), entry->d_name );
-            *x = '\0';
+            std::memcpy( entry, ent, ent->d_reclen );
             *result = entry;
-            dir->next();
         }
         else
             *result = nullptr;
@@ -767,7 +865,7 @@ void rewinddir( DIR *dirp ) {
     FS_ENTRYPOINT();
     int e = errno;
     try {
-        vfs.instance().getDirectory( dirp )->rewind();
+        vfs.instance().seekDirectory( dirp, 0 );
     } catch ( Error & ) {
         errno = e;
     }
@@ -786,37 +884,34 @@ int scandir( const char *path, struct dirent ***namelist,
         int fd = vfs.instance().openFileAt( divine::fs::CURRENT_DIRECTORY, path, f, 0 );
         dirp = vfs.instance().openDirectory( fd );
 
-        struct dirent **entries = nullptr;
-        struct dirent *workingEntry = (struct dirent *)FS_MALLOC( sizeof( struct dirent ) );
-
-        while ( true ) {
-            auto dir = vfs.instance().getDirectory( dirp );
-            auto ent = dir->get();
-            if ( !ent )
-                break;
+        auto dir = vfs.instance().getDirectory( dirp );
 
-            workingEntry->d_ino = ent->ino();
-            char *x = std::copy( ent->name().begin(), ent->name().end(), workingEntry->d_name );
-            *x = '\0';
-            dir->next();
+        // the number of entries is known up front, the array grows only if
+        // entries are created meanwhile
+        size_t capacity = std::max< size_t >( vfs.instance().getFile( fd )->size(), 1 );
+        struct dirent **entries = (struct dirent **)FS_MALLOC( capacity * sizeof( struct dirent * ) );
 
-            if ( filter && !filter( workingEntry ) )
+        while ( struct dirent *ent = _nextEntry( dir ) ) {
+            if ( filter && !filter( ent ) )
                 continue;
 
-            struct dirent **newEntries = (struct dirent **)FS_MALLOC( ( length + 1 ) * sizeof( struct dirent * ) );
-            if ( length )
+            if ( size_t( length ) == capacity ) {
+                capacity *= 2;
+                struct dirent **newEntries = (struct dirent **)FS_MALLOC( capacity * sizeof( struct dirent * ) );
                 std::memcpy( newEntries, entries, length * sizeof( struct dirent * ) );
-            std::swap( entries, newEntries );
-            std::free( newEntries );
-            entries[ length ] = workingEntry;
-            workingEntry = (struct dirent *)FS_MALLOC( sizeof( struct dirent ) );
+                std::swap( entries, newEntries );
+                std::free( newEntries );
+            }
+            // callers free the entries one by one
+            entries[ length ] = (struct dirent *)FS_MALLOC( ent->d_reclen );
+            std::memcpy( entries[ length ], ent, ent->d_reclen );
             ++length;
         }
-        std::free( workingEntry );
         vfs.instance().closeDirectory( dirp );
 
         typedef int( *cmp )( const void *, const void * );
-        std::qsort( entries, length, sizeof( struct dirent * ), reinterpret_cast< cmp >( compare ) );
+        if ( compare )
+            std::qsort( entries, length, sizeof( struct dirent * ), reinterpret_cast< cmp >( compare ) );
 
         *namelist = entries;
         return length;
@@ -831,7 +926,7 @@ long telldir( DIR *dirp ) {
     FS_ENTRYPOINT();
     int e = errno;
     try {
-        return vfs.instance().getDirectory( dirp )->tell();
+        return vfs.instance().tellDirectory( dirp );
     } catch ( Error & ) {
         return -1;
     }
@@ -840,7 +935,7 @@ void seekdir( DIR *dirp, long offset ) {
     FS_ENTRYPOINT();
     int e = errno;
     try {
-        vfs.instance().getDirectory( dirp )->seek( offset );
+        vfs.instance().seekDirectory( dirp, offset );
     } catch ( Error & ) {
         errno = e;
     }
@@ -1116,7 +1211,7 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
         return nullptr;
     }
     try {
-        return vfs.instance().mmap(fd, len, offset, conversion::map(flags));
+        return vfs.instance().mmap(fd, len, offset, conversion::map(flags), conversion::protection(prot));
     } catch ( Error & ) {
         return nullptr;
     }
@@ -1124,15 +1219,39 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
 
 
 int munmap(void *addr, size_t len) {
+    FS_ENTRYPOINT();
     if (addr != nullptr) {
         try {
-            vfs.instance().munmap(addr);
+            vfs.instance().munmap(addr, len);
             return 0;
         }catch (Error &){
             return -1;
         }
     }
+    errno = EINVAL;
     return -1;
 }
 
+int mprotect( void *addr, size_t len, int prot ) {
+    FS_ENTRYPOINT();
+    try {
+        vfs.instance().mprotect( addr, len, conversion::protection( prot ) );
+        return 0;
+    } catch ( Error & ) {
+        return -1;
+    }
+}
+
+int msync( void *addr, size_t len, int flags ) {
+    FS_ENTRYPOINT();
+    try {
+        if ( ( flags & MS_SYNC ) && ( flags & MS_ASYNC ) )
+            throw Error( EINVAL );
+        vfs.instance().msync( addr, len );
+        return 0;
+    } catch ( Error & ) {
+        return -1;
+    }
+}
+
 } // extern "C"
@@ -0,0 +1,93 @@
+#ifndef _SYS_RESOURCE_H
+#define _SYS_RESOURCE_H  1
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned long rlim_t;
+
+#define RLIM_INFINITY   ( ( rlim_t ) -1 )
+
+/* Only the limit of open file descriptors is modelled, the other resources
+   are reported as unlimited.  */
+enum __rlimit_resource {
+    /* Per-process CPU limit, in seconds.  */
+    RLIMIT_CPU = 0,
+    /* Largest file that can be created, in bytes.  */
+    RLIMIT_FSIZE = 1,
+    /* Maximum size of data segment, in bytes.  */
+    RLIMIT_DATA = 2,
+    /* Maximum size of stack segment, in bytes.  */
+    RLIMIT_STACK = 3,
+    /* Largest core file that can be created, in bytes.  */
+    RLIMIT_CORE = 4,
+    /* Largest resident set size, in bytes.  */
+    RLIMIT_RSS = 5,
+    /* Number of processes.  */
+    RLIMIT_NPROC = 6,
+    /* Number of open files.  */
+    RLIMIT_NOFILE = 7,
+    /* Locked-in-memory address space.  */
+    RLIMIT_MEMLOCK = 8,
+    /* Address space limit.  */
+    RLIMIT_AS = 9,
+    /* Maximum number of file locks.  */
+    RLIMIT_LOCKS = 10,
+    /* Maximum number of pending signals.  */
+    RLIMIT_SIGPENDING = 11,
+    /* Maximum bytes in POSIX message queues.  */
+    RLIMIT_MSGQUEUE = 12,
+    /* Maximum nice priority allowed to raise to.  */
+    RLIMIT_NICE = 13,
+    /* Maximum realtime priority allowed for unprivileged processes.  */
+    RLIMIT_RTPRIO = 14,
+    /* Maximum CPU time in microseconds that a process scheduled under a
+       real-time scheduling policy may consume without making a blocking
+       system call before being forcibly descheduled.  */
+    RLIMIT_RTTIME = 15,
+
+    RLIMIT_NLIMITS = 16
+};
+#define RLIMIT_CPU RLIMIT_CPU
+#define RLIMIT_FSIZE RLIMIT_FSIZE
+#define RLIMIT_DATA RLIMIT_DATA
+#define RLIMIT_STACK RLIMIT_STACK
+#define RLIMIT_CORE RLIMIT_CORE
+#define RLIMIT_RSS RLIMIT_RSS
+#define RLIMIT_NPROC RLIMIT_NPROC
+#define RLIMIT_NOFILE RLIMIT_NOFILE
+#define RLIMIT_OFILE RLIMIT_NOFILE
+#define RLIMIT_MEMLOCK RLIMIT_MEMLOCK
+#define RLIMIT_AS RLIMIT_AS
+#define RLIMIT_LOCKS RLIMIT_LOCKS
+#define RLIMIT_SIGPENDING RLIMIT_SIGPENDING
+#define RLIMIT_MSGQUEUE RLIMIT_MSGQUEUE
+#define RLIMIT_NICE RLIMIT_NICE
+#define RLIMIT_RTPRIO RLIMIT_RTPRIO
+#define RLIMIT_RTTIME RLIMIT_RTTIME
+#define RLIMIT_NLIMITS RLIMIT_NLIMITS
+
+struct rlimit {
+    /* The current (soft) limit.  */
+    rlim_t rlim_cur;
+    /* The hard limit.  */
+    rlim_t rlim_max;
+};
+
+/* Put the soft and hard limits for RESOURCE in *RLIMITS.
+   Returns 0 if successful, -1 if not (and sets errno).  */
+extern int getrlimit( int resource, struct rlimit *rlimits );
+
+/* Set the soft and hard limits for RESOURCE to *RLIMITS.
+   Only the super-user can increase hard limits.
+   Return 0 if successful, -1 if not (and sets errno).  */
+extern int setrlimit( int resource, const struct rlimit *rlimits );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sys/resource.h */
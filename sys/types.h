@@ -9,7 +9,7 @@
 #ifndef __divine__
 #if defined( __MAC_OS_X_VERSION_MAX_ALLOWED )
 typedef __darwin_socklen_t         socklen_t;
-#elif
+#else
 typedef __socklen_t         socklen_t;
 #endif
 #else
@@ -34,6 +34,7 @@ typedef __uint32_t          mode_t;
 
 typedef __uint32_t          dev_t;
 typedef __uint32_t          ino_t;
+typedef __uint64_t          ino64_t;
 
 typedef __uint32_t          nlink_t;
 typedef __uint32_t          blksize_t;